@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010), run on the CPU.
+///
+/// The radiance is divided by the first hit albedo before filtering and multiplied back after,
+/// so that texture and material detail is not blurred away with the noise.
+struct Denoiser {
+	/// Number of filter passes, each doubling the footprint of the 5x5 kernel
+	int iterations = 5;
+	/// Edge-stopping strengths, smaller values preserve more detail
+	float sigma_color = 0.6f;
+	float sigma_normal = 0.1f;
+	/// Relative to the depth of the center pixel
+	float sigma_depth = 0.05f;
+
+	/// Filters `color` (running mean in xyz, sample count in w) into `output`.
+	/// `albedo` and `normal` are stored in xyz, `depth` is INFINITY for the sky.
+	void denoise(
+		int width, int height, const std::vector<glm::vec4> &color,
+		const std::vector<glm::vec4> &albedo, const std::vector<glm::vec4> &normal,
+		const std::vector<float> &depth, std::vector<glm::vec4> &output
+	);
+
+	Denoiser();
+	~Denoiser();
+
+  private:
+	/// Threads kept between passes and frames, started by the first `denoise`
+	class Pool;
+	std::unique_ptr<Pool> pool;
+
+	std::vector<glm::vec3> ping;
+	std::vector<glm::vec3> pong;
+
+	/// Calls `fn(y)` for every row, split over the threads of the pool
+	template <typename F> void parallel_rows(int height, F fn);
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#define CL_TARGET_OPENCL_VERSION 200
+#include <boost/compute/types.hpp>
+
+namespace fs = std::filesystem;
+
+/// Renders an image over several processes, possibly on other machines.
+///
+/// The coordinator sends the scene to every worker once, then hands out jobs (a band of rows
+/// and a range of frames) whenever a worker is free. Workers send back their raw accumulated
+/// samples, which the coordinator merges weighted by sample count before tonemapping.
+/// Messages are the in-memory bytes of the structs, so every process must run the same build.
+namespace farm {
+
+struct CoordinatorConfig {
+	/// host:port of every worker
+	std::vector<std::string> workers;
+	/// Name of a built-in scene
+	std::string scene = "spheres";
+	int width = 960;
+	int height = 540;
+	int num_samples = 4;
+	int num_bounces = 10;
+	/// Frames accumulated per pixel, each of `num_samples` samples
+	cl_uint frames = 64;
+	/// Height of the bands handed out
+	int band_rows = 64;
+	/// Frames of a band rendered by a single job. Smaller values split the samples of each band
+	/// across several workers.
+	cl_uint frames_per_job = 64;
+	fs::path output = "farm.ppm";
+};
+
+/// Listens on `port` and serves one coordinator after the other, until killed
+int run_worker(uint16_t port);
+
+/// Renders the image on the workers and writes it to `config.output`
+int run_coordinator(const CoordinatorConfig &config);
+
+} // namespace farm
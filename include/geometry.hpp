@@ -0,0 +1,139 @@
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define CL_TARGET_OPENCL_VERSION 200
+#include <boost/compute/buffer.hpp>
+#include <boost/compute/core.hpp>
+#include <boost/compute/types.hpp>
+
+#include "shape.hpp"
+
+namespace compute = boost::compute;
+
+/// Device side of the meshes of the models, for scenes whose triangles don't fit in device memory.
+///
+/// The triangles of every mesh are clustered spatially into pages. The bounds of the pages of
+/// every model are always resident, while their triangles live in a pool of slots within a fixed
+/// memory budget. The kernel tests the bounds of a page before its triangles and marks the pages
+/// it crosses in a feedback buffer. Samples whose path may have stopped in a page that isn't
+/// resident are dropped. After each frame, `stream` uploads the missing pages in place of the
+/// least recently used ones.
+class GeometryCache {
+  public:
+	/// Triangles per page, same as GEOMETRY_PAGE_TRIANGLES in the kernel
+	static constexpr size_t page_triangles = 512;
+	/// Page table entry of a page that isn't resident
+	static constexpr cl_uint not_resident = 0xFFFFFFFF;
+
+	/// World space bounds of a page for one model, same layout as in the kernel
+	struct PageBounds {
+		/// The w component holds the index of the page, as bits
+		cl_float4 bounds_min;
+		/// The w component holds the number of triangles of the page, as bits
+		cl_float4 bounds_max;
+	};
+
+	/// Most pages uploaded after a frame, bounds the time spent streaming
+	size_t max_uploads = 256;
+
+	GeometryCache() = default;
+	explicit GeometryCache(const compute::context &context);
+
+	/// Clusters the meshes of the models into pages, in the compressed format if `compress` is
+	/// set, and allocates `budget` bytes of pages on the device. Does nothing if the meshes, format
+	/// and budget are the same as the last call. Throws std::runtime_error if the budget can't
+	/// hold a single page.
+	void reset(
+		const std::vector<Shape> &shapes, const std::vector<Triangle> &triangles, bool compress,
+		size_t budget, compute::command_queue &queue
+	);
+
+	/// Points `models` to the pages of their mesh and uploads the world space bounds of those
+	/// pages, the meshes must have been paged by `reset`
+	void place(std::vector<Model> &models, compute::command_queue &queue);
+
+	/// Uploads the missing pages crossed by the last frame and clears the feedback, must be called
+	/// once the feedback read by `read_feedback` is complete
+	void stream(compute::command_queue &queue);
+
+	/// Reads back the feedback of the frame just enqueued, done once the queue reaches it
+	void read_feedback(compute::command_queue &queue);
+
+	size_t num_pages() const {
+		return page_table.size();
+	}
+	size_t num_slots() const {
+		return slots.size();
+	}
+	size_t resident_pages() const {
+		return num_resident;
+	}
+	/// Pages crossed by the last frame that weren't resident yet
+	size_t missing_pages() const {
+		return num_missing;
+	}
+	/// Wether the pages crossed by the last frame didn't all fit in the pool. The samples needing
+	/// the others are dropped every frame, so those pixels never converge.
+	bool budget_too_small() const {
+		return too_small;
+	}
+
+	compute::buffer buffer_bounds;
+	compute::buffer buffer_page_table;
+	compute::buffer buffer_pool;
+	/// One byte per page, set by the kernel when a ray crosses the bounds of the page
+	compute::buffer buffer_feedback;
+
+  private:
+	/// Pages of a mesh, shared by every model using it
+	struct Mesh {
+		cl_uint first_page;
+		cl_uint num_pages;
+	};
+
+	struct Page {
+		/// Object space bounds, padded so they are never empty
+		glm::vec3 local_min;
+		glm::vec3 local_max;
+		cl_uint num_triangles;
+	};
+
+	struct Slot {
+		/// Page in this slot, `not_resident` if it is free
+		cl_uint page = not_resident;
+		/// Last frame that crossed the page
+		uint64_t last_used = 0;
+	};
+
+	/// First triangle and number of triangles of every mesh paged, with the format and budget,
+	/// to tell when `reset` has to page them again
+	std::vector<std::pair<cl_uint, cl_uint>> layout;
+	bool compressed = false;
+	size_t layout_budget = 0;
+
+	/// Indexed by the first triangle of the mesh
+	std::unordered_map<cl_uint, Mesh> meshes;
+	std::vector<Page> pages;
+	/// Triangles of every page in the device format, each page padded to `page_triangles`
+	std::vector<uint8_t> page_data;
+	size_t page_size = 0;
+
+	/// Slot of the pool holding each page, or `not_resident`
+	std::vector<cl_uint> page_table;
+	std::vector<Slot> slots;
+	std::vector<cl_uchar> feedback;
+
+	uint64_t frame = 0;
+	size_t num_resident = 0;
+	size_t num_missing = 0;
+	bool too_small = false;
+
+	/// Splits a mesh into pages and appends them to `pages` and `page_data`
+	void add_mesh(const Model &model, const std::vector<Triangle> &triangles);
+
+	/// Writes a page to a slot of the pool and points the page table to it
+	void upload(compute::command_queue &queue, cl_uint page, cl_uint slot);
+};
@@ -12,6 +12,7 @@
 #include <glm/vec3.hpp>
 
 #include "material.hpp"
+#include "texture.hpp"
 
 struct Camera {
 	glm::vec3 position;
@@ -33,6 +34,8 @@ struct Camera {
 struct MaterialHelper {
 	std::vector<Material> materials;
 	std::vector<std::string> names;
+	/// Textures referenced by the materials, only ever added to
+	TextureAtlas textures;
 
 	MaterialHelper() : materials(), names() {
 	}
@@ -13,6 +13,7 @@
 
 #include "helper.hpp"
 #include "parser.hpp"
+#include "profiler.hpp"
 #include "shape.hpp"
 #include "tracer.hpp"
 
@@ -83,13 +84,14 @@ bool camera_parameters(
 	const std::vector<uint8_t> &pixels, glm::ivec2 canvas_size
 );
 
-bool render_parameters(Tracer::RenderData &render_data, bool &render_raytracing);
+bool render_parameters(Tracer &tracer, bool &render_raytracing);
 
 bool material_window(MaterialHelper &materials, std::vector<Shape> &shapes);
 
+/// Also plots the time of every stage recorded by `profiler`, and captures traces
 void frame_time_window(
 	std::deque<float> &frame_times, int &num_frame_samples, bool &limit_fps, int &fps_limit,
-	bool &log_fps
+	bool &log_fps, Profiler &profiler
 );
 
 struct GuizmoHelper {
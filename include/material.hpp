@@ -20,6 +20,12 @@ struct Material {
 	alignas(cl_float3) Color color;
 	alignas(cl_float3) Color emission;
 
+	/// Textures of the scene's TextureAtlas, -1 for none. The albedo and emission textures
+	/// multiply the color and emission, the red channel of the roughness replaces the smoothness.
+	cl_int albedo_texture = -1;
+	cl_int roughness_texture = -1;
+	cl_int emission_texture = -1;
+
 	Material(
 		const Color &color = color::white, float smoothness = 0.0f, float metallic = 0.0f, float specular = 0.0f,
 		float transmittance = 0.0f, float refraction_index = 1.0f, const Color &emission = color::black,
@@ -36,3 +42,27 @@ struct Material {
 		this->emission_strength = emission_strength;
 	}
 };
+
+/// Layout of a material on the device, with the values the kernel
+/// derives from it computed once on upload
+struct PackedMaterial {
+	/// Base color (xyz) and smoothness (w)
+	cl_float4 color;
+	/// Emission scaled by its strength (xyz) and Fresnel reflectance at normal incidence (w)
+	cl_float4 emission;
+	/// Probabilities of a metallic, specular and transmitted bounce (xyz) and refraction index (w)
+	cl_float4 lobes;
+	/// Albedo, roughness and emission textures, -1 for none
+	cl_int4 textures;
+
+	explicit PackedMaterial(const Material &material) {
+		// Shlick's r0 is the same going in or out of the material
+		float r0 = (1.0f - material.refraction_index) / (1.0f + material.refraction_index);
+		Color emitted = material.emission * material.emission_strength;
+
+		color = {{material.color.r, material.color.g, material.color.b, material.smoothness}};
+		emission = {{emitted.r, emitted.g, emitted.b, r0 * r0}};
+		lobes = {{material.metallic, material.specular, material.transmittance, material.refraction_index}};
+		textures = {{material.albedo_texture, material.roughness_texture, material.emission_texture, -1}};
+	}
+};
@@ -22,7 +22,7 @@ using ModelPair = std::pair<uint, uint>;
 std::optional<ModelPair> load_stl_model(const fs::path &filename, std::vector<Triangle> &triangles);
 
 /// Loads the triangles of a model from an OBJ wavefront file.
-/// Currently does not support smooth shading, texture coordinates and probably more.
+/// Keeps the texture coordinates, but does not support materials and probably more.
 /// Returns the triangle index at which the model starts and its number of triangles.
 /// Returns nullopt if the given file does not exist
 std::optional<ModelPair> load_obj_model(const std::filesystem::path filename, std::vector<Triangle> &triangles); 
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#define CL_TARGET_OPENCL_VERSION 200
+#include <boost/compute/event.hpp>
+
+namespace compute = boost::compute;
+namespace fs = std::filesystem;
+
+/// Durations of the stages of the last frames, in milliseconds.
+///
+/// Stages are created the first time they are recorded, and keep their order of creation.
+/// Every frame, the time recorded for each stage is summed, and pushed to a ring buffer by
+/// `end_frame`. On demand, the individual spans of a few frames can also be captured to a
+/// Chrome trace, showing how the host and the device overlap.
+class Profiler {
+  public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Stage {
+		std::string name;
+		/// Measured with OpenCL events instead of the host clock
+		bool device;
+		/// Last frames, the oldest one being at `Profiler::offset()`
+		std::vector<float> history;
+		/// Sum of the time recorded this frame
+		float current = 0.0f;
+
+		float average() const;
+	};
+
+	explicit Profiler(size_t capacity = 120);
+
+	/// Adds the span to the current frame of a stage
+	void record(const std::string &name, Clock::time_point start, Clock::time_point end, bool device = false);
+	/// Adds the duration of a completed event. Its queue needs profiling enabled.
+	/// @param enqueued Host time right after the command was enqueued, to place it on the host
+	/// timeline
+	void record(const std::string &name, const compute::event &event, Clock::time_point enqueued);
+
+	/// Starts timing a host stage, ending the previous one
+	void begin(const std::string &name);
+	/// Ends the host stage started last
+	void end();
+
+	/// Pushes the current frame to the history of every stage
+	void end_frame();
+
+	/// Records every span of the next `frames` frames, and writes them to `path` as a Chrome
+	/// trace (chrome://tracing or ui.perfetto.dev) once done
+	void capture(int frames, const fs::path &path);
+
+	bool capturing() const {
+		return frames_to_capture > 0;
+	}
+
+	const std::vector<Stage> &stages() const {
+		return stage_list;
+	}
+
+	size_t capacity() const {
+		return frame_capacity;
+	}
+
+	/// Index of the oldest frame in the histories
+	size_t offset() const {
+		return next_frame;
+	}
+
+  private:
+	size_t frame_capacity;
+	size_t next_frame = 0;
+	std::vector<Stage> stage_list;
+
+	/// Host stage being timed, empty if none
+	std::string running;
+	Clock::time_point running_start;
+
+	struct Span {
+		std::string name;
+		bool device;
+		Clock::time_point start;
+		Clock::time_point end;
+	};
+
+	int frames_to_capture = 0;
+	fs::path capture_path;
+	std::vector<Span> captured;
+	Clock::time_point frame_start = Clock::now();
+
+	Stage &stage(const std::string &name, bool device);
+	void write_capture() const;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <glm/gtc/constants.hpp>
+
+#include "helper.hpp"
+#include "shape.hpp"
+#include "tracer.hpp"
+
+/// Scene built in code, rendered without the interface by the render farm and the benchmark
+struct SceneDescription {
+	std::vector<Shape> shapes;
+	std::vector<Triangle> triangles;
+	std::vector<Material> materials;
+	TextureAtlas textures;
+
+	Camera camera = {{0.0f, 0.0f, 5.0f}, 0.0f, 0.0f};
+	float fov = glm::pi<float>() / 2.f;
+
+	/// Sets the camera and projection of `options` for its current resolution
+	void apply_camera(Tracer::RenderData &options) const;
+};
+
+namespace scenes {
+
+/// Sky used by the interface and the built-in scenes
+void default_sky(Tracer::SceneData &scene_data);
+
+/// A few spheres of different materials on a ground plane, lit by the sky
+SceneDescription spheres();
+
+/// A grid of `count` x `count` small spheres with random materials, stresses the shape loop
+SceneDescription many_spheres(int count = 32);
+
+/// Closed Cornell box built from `Box` models, lit by an emissive box on the ceiling
+SceneDescription cornell_box();
+
+/// A single large mesh on a checkered ground plane. Loads `file` (STL or OBJ) if given,
+/// otherwise generates a torus of `2 * rings * sides` triangles.
+SceneDescription mesh(const fs::path &file = {}, int rings = 96, int sides = 48);
+
+/// Refractive spheres and boxes, paths go through many transmission events
+SceneDescription glass();
+
+/// Names accepted by `by_name`
+std::vector<std::string> names();
+
+/// Returns nullopt if no built-in scene has this name
+std::optional<SceneDescription> by_name(const std::string &name);
+
+} // namespace scenes
@@ -29,7 +29,10 @@ struct Plane {
 struct Triangle {
 	struct Vertex {
 		alignas(cl_float3) glm::vec3 normal;
+		/// Texture coordinates, stored in the padding after the normal and the position
+		float u = 0.0f;
 		alignas(cl_float3) glm::vec3 pos;
+		float v = 0.0f;
 	};
 
 	Vertex vertices[3];
@@ -43,13 +46,38 @@ struct Triangle {
 	Triangle(Vertex v0, Vertex v1, Vertex v2);
 };
 
+/// Triangle of a compressed mesh, 48 bytes instead of 96
+struct PackedTriangle {
+	struct Vertex {
+		/// Position quantized over the object space bounds of its model (xyz) and u as a half (w)
+		cl_ushort4 position;
+		/// Octahedral normal as two snorm16 (xy) and v as a half (z)
+		cl_ushort4 normal;
+	};
+
+	Vertex vertices[3];
+
+	/// Initialize every field to 0
+	PackedTriangle();
+
+	/// Quantize `triangle` over the object space bounds of its model
+	PackedTriangle(const Triangle &triangle, glm::vec3 local_min, glm::vec3 local_max);
+};
+
 /// Collection of triangles
 struct Model {
 	cl_uint triangle_index;
 	cl_uint num_triangles;
+	/// Bounds of the pages of the mesh, set by the tracer when the meshes are paged
+	cl_uint first_page = 0;
+	cl_uint num_pages = 0;
+	/// World space bounds, derived from the object space bounds and the transform
 	alignas(cl_float3) glm::vec3 bounding_min;
 	alignas(cl_float3) glm::vec3 bounding_max;
 	alignas(cl_float3) glm::mat4 transform;
+	/// Object space bounds of the mesh, computed once
+	alignas(cl_float3) glm::vec3 local_min;
+	alignas(cl_float3) glm::vec3 local_max;
 
 	Model();
 
@@ -58,7 +86,12 @@ struct Model {
 		const std::vector<Triangle> &triangles, cl_uint triangle_index, cl_uint num_triangles
 	);
 
-	void compute_bounding_box(const std::vector<Triangle> &triangles);
+	/// Compute the object space bounds by going over every vertex of the mesh
+	void compute_local_bounds(const std::vector<Triangle> &triangles);
+
+	/// Recalculate the world space bounding box from the 8 transformed corners of the object
+	/// space bounds. This is conservative: it can be looser than the exact bounds under rotation.
+	void compute_bounding_box();
 
 	/// Change position and recalculate bounding box
 	// void move(glm::vec3 position);
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#define CL_TARGET_OPENCL_VERSION 200
+#include <boost/compute/buffer.hpp>
+#include <boost/compute/core.hpp>
+#include <boost/compute/types.hpp>
+
+namespace compute = boost::compute;
+namespace fs = std::filesystem;
+
+/// Textures of a scene, with their mip chains packed one after the other, referenced by index
+/// from the materials
+struct TextureAtlas {
+	/// Width and height of a tile in texels, same as TEXTURE_TILE_SIZE in the kernel
+	static constexpr int tile_size = 64;
+	static constexpr size_t tile_texels = tile_size * tile_size;
+
+	/// Location of a texture in `texels`
+	struct Texture {
+		/// Index of the first tile of the full resolution level, the smaller levels follow
+		size_t first_tile;
+		cl_int width;
+		cl_int height;
+		cl_int num_levels;
+	};
+
+	std::vector<Texture> textures;
+	std::vector<std::string> names;
+	/// RGBA8 tiles of `tile_texels`, each level split row by row. Rows from the bottom up, the
+	/// texels of partial tiles past the edge of their level are black.
+	std::vector<cl_uchar4> texels;
+
+	/// Loads an image file and returns its index, or -1 if it couldn't be read
+	int load(const fs::path &file);
+
+	/// Adds `width` * `height` RGBA8 pixels (rows from the bottom up) and builds their mip chain.
+	/// Returns the index of the texture.
+	int add(const std::string &name, int width, int height, const uint8_t *pixels);
+
+	/// Adds a two colored checkerboard of `squares` x `squares` squares
+	int add_checker(const std::string &name, int size, int squares, cl_uchar4 a, cl_uchar4 b);
+
+	size_t size() const {
+		return textures.size();
+	}
+	size_t num_tiles() const {
+		return texels.size() / tile_texels;
+	}
+};
+
+/// Device side of a TextureAtlas, split into square tiles of which only those sampled recently
+/// are resident, within a fixed memory budget.
+///
+/// The kernel marks every tile it samples in a feedback buffer and falls back to a coarser
+/// level when a tile is missing. After each frame, `stream` uploads the missing tiles from the
+/// atlas in place of the least recently used ones. The levels that fit in a single tile are always resident,
+/// so there is always something to fall back to. The pool starts filled, so an atlas that fits in
+/// the budget is entirely resident.
+class TextureCache {
+  public:
+	static constexpr int tile_size = TextureAtlas::tile_size;
+	static constexpr size_t tile_texels = TextureAtlas::tile_texels;
+	/// Page table entry of a tile that isn't resident
+	static constexpr cl_uint not_resident = 0xFFFFFFFF;
+
+	/// Location of a texture in the page table, same layout as in the kernel
+	struct VirtualTexture {
+		/// Page table entry of the first tile of the full resolution level, the smaller levels follow
+		cl_uint first_tile;
+		cl_int width;
+		cl_int height;
+		cl_int num_levels;
+	};
+
+	/// Most tiles uploaded after a frame, bounds the time spent streaming
+	size_t max_uploads = 64;
+
+	TextureCache() = default;
+	explicit TextureCache(const compute::context &context);
+
+	/// Allocates `budget` bytes of tiles on the device and fills them from `atlas`, which later
+	/// uploads read from so it has to be kept until the next reset. Throws std::runtime_error if
+	/// the budget can't even hold the coarse levels.
+	void reset(const TextureAtlas &atlas, size_t budget, compute::command_queue &queue);
+
+	/// Uploads the missing tiles sampled by the last frame and clears the feedback, must be
+	/// called once the feedback read by `read_feedback` is complete. Returns wether the samples
+	/// so far should be restarted: the camera rays shaded some tiles with coarser levels, and
+	/// all of those are resident now. Fallbacks of the other bounces are blended in instead.
+	bool stream(compute::command_queue &queue);
+
+	/// Reads back the feedback of the frame just enqueued, done once the queue reaches it
+	void read_feedback(compute::command_queue &queue);
+
+	size_t num_tiles() const {
+		return page_table.size();
+	}
+	size_t num_slots() const {
+		return slots.size();
+	}
+	size_t resident_tiles() const {
+		return num_resident;
+	}
+	/// Tiles sampled by the last frame that weren't resident yet
+	size_t missing_tiles() const {
+		return num_missing;
+	}
+
+	compute::buffer buffer_textures;
+	compute::buffer buffer_page_table;
+	compute::buffer buffer_pool;
+	/// Two bytes per tile, set by the kernel. The first when the tile is sampled, the second when
+	/// a camera ray needed it while it wasn't resident.
+	compute::buffer buffer_feedback;
+
+  private:
+	struct Slot {
+		/// Page table entry of the tile in this slot, `not_resident` if it is free
+		cl_uint tile = not_resident;
+		/// Last frame that sampled the tile
+		uint64_t last_used = 0;
+		/// Coarse levels are never evicted
+		bool pinned = false;
+	};
+
+	/// Atlas of the last reset, its tiles are in page table order
+	const TextureAtlas *source = nullptr;
+	/// Slot of the pool holding each tile, or `not_resident`
+	std::vector<cl_uint> page_table;
+	std::vector<Slot> slots;
+	std::vector<cl_uchar> feedback;
+
+	uint64_t frame = 0;
+	size_t num_resident = 0;
+	size_t num_missing = 0;
+
+	/// Writes a tile to a slot of the pool and points the page table to it
+	void upload(compute::command_queue &queue, cl_uint tile, cl_uint slot);
+};
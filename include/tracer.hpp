@@ -1,5 +1,9 @@
 #pragma once
 
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #define CL_TARGET_OPENCL_VERSION 200
@@ -15,59 +19,297 @@
 #include <stb_image.h>
 
 #include "color.hpp"
+#include "denoiser.hpp"
+#include "geometry.hpp"
 #include "material.hpp"
+#include "profiler.hpp"
 #include "shape.hpp"
+#include "texture.hpp"
 
 namespace compute = boost::compute;
+namespace fs = std::filesystem;
 
 #define VEC3TOCL(v) (cl_float3({{(v).x, (v).y, (v).z}}))
 #define VEC4TOCL(v) (cl_float4({{(v).x, (v).y, (v).z, (v).w}}))
 
+/// Source of the random numbers in the kernel
+enum SamplerType {
+	SAMPLER_RANDOM,
+	/// Owen scrambled Sobol, converges faster
+	SAMPLER_SOBOL
+};
+
+/// Counter shown by the cost heatmap, in the order of the components of the cost buffer
+enum HeatmapMetric {
+	HEATMAP_SHAPE_TESTS,
+	/// Model bounding box tests
+	HEATMAP_AABB_TESTS,
+	HEATMAP_TRIANGLE_TESTS,
+	HEATMAP_BOUNCES
+};
+
+/// Work done by a frame, indexed by HeatmapMetric
+struct CostTotals {
+	cl_ulong total[4] = {0, 0, 0, 0};
+	/// Largest count of a single pixel
+	cl_uint max[4] = {0, 0, 0, 0};
+	size_t num_pixels = 0;
+};
+
+/// Rays traced and intersection tests done by a frame
+struct RayStats {
+	cl_ulong primary_rays = 0;
+	cl_ulong bounce_rays = 0;
+	cl_ulong sky_escapes = 0;
+	/// Paths that ran out of bounces instead of escaping to the sky
+	cl_ulong terminated_paths = 0;
+	cl_ulong sphere_tests = 0;
+	cl_ulong plane_tests = 0;
+	/// Model bounding box tests
+	cl_ulong model_tests = 0;
+	cl_ulong triangle_tests = 0;
+
+	cl_ulong rays() const {
+		return primary_rays + bounce_rays;
+	}
+
+	RayStats &operator+=(const RayStats &other);
+};
+
 class Tracer {
+  public:
+	/// Triangles and object space bounds of a mesh
+	struct MeshRange {
+		cl_uint triangle_index;
+		cl_uint num_triangles;
+		glm::vec3 local_min;
+		glm::vec3 local_max;
+
+		bool operator==(const MeshRange &) const = default;
+	};
+
   private:
     compute::device device;
     compute::context context;
 
-    compute::program program;
+    /// Program compiled with a given set of build options
+    struct Variant {
+        compute::program program;
+        compute::kernel render;
+        compute::kernel average;
+        compute::kernel reproject;
+        compute::kernel heatmap;
+    };
+
+    std::string source;
+    /// Every variant compiled so far, indexed by their build options
+    std::unordered_map<std::string, Variant> variants;
+    std::string current_variant;
+
+    /// Kernels of the current variant
     compute::kernel kernel;
     compute::kernel average_kernel;
+    compute::kernel reproject_kernel;
+    compute::kernel heatmap_kernel;
 
     compute::command_queue queue;
 
+    /// Running mean of the samples (xyz) and sample count (w) as float4, or the means as half3
+    /// followed by the counts as uint
     compute::buffer render_canvas;
     compute::buffer render_output;
+    /// Distance to the first hit of each pixel (INFINITY for the sky)
+    compute::buffer render_depth;
+    /// First hit albedo and normal (float4), only written when denoising
+    compute::buffer render_albedo;
+    compute::buffer render_normals;
+    /// Output of the denoiser, always float4
+    compute::buffer denoised_canvas;
+    /// Per pixel counters of the last frame (uint4, see HeatmapMetric), only written for the heatmap
+    compute::buffer render_cost;
+
+    /// Canvas and depth of the previous camera position, used for reprojection
+    compute::buffer history_canvas;
+    compute::buffer history_depth;
 
-	compute::buffer buffer_shapes;
+	/// Shapes sorted by type, in compact per type arrays (see `update_scene`)
+	compute::buffer buffer_spheres;
+	compute::buffer buffer_planes;
+	compute::buffer buffer_models;
+	compute::buffer buffer_shape_materials;
 	compute::buffer buffer_triangles;
 	compute::buffer buffer_materials;
 
 	compute::image2d skybox;
 	compute::image_sampler sampler;
 
+	/// Wether the last frame was rendered at a reduced resolution
+	bool previewing = false;
+
+	/// Camera the history was rendered with
+	struct ReprojectionData {
+		alignas(cl_float4) glm::mat4 world_to_camera;
+		cl_float aspect_ratio;
+		cl_float fov_scale;
+		cl_float depth_tolerance;
+		cl_float max_history;
+	} reprojection_data;
+
+	/// Wether the next frame should be merged with the history
+	bool pending_reprojection = false;
+
+	/// Index of the next frame in the sample sequences, only reset when the canvas is cleared
+	cl_uint frame_index = 0;
+
+	/// Rows of the image rendered by this tracer, the whole image unless splitting across devices
+	int band_begin = 0;
+	int band_end;
+	/// Completion of the rendering of the last frame, before denoising and tonemapping
+	compute::event frame_event;
+	/// Completion of the last readback
+	compute::event readback_event;
+
+	/// Tracers of the other devices, each rendering its own band of the image
+	std::vector<std::unique_ptr<Tracer>> secondary;
+	/// Smoothed rows per second of this device followed by the secondary ones
+	std::vector<double> device_throughput = {1.0};
+
+	/// Totals of this tracer's band
+	CostTotals band_cost;
+	/// Cost drawn at full intensity by the heatmap, the most expensive pixel of every band
+	cl_float heatmap_scale = 1.0f;
+
+	/// Counters of the render kernel as (low, high) pairs, in the order of RayStats
+	static constexpr int num_ray_stats = 7;
+	compute::buffer buffer_stats;
+	cl_uint host_stats[2 * num_ray_stats] = {};
+	/// Wether `host_stats` was counted by the last frame
+	bool stats_counted = false;
+
+	/// Profiled command enqueued since the last readback
+	struct PendingEvent {
+		const char *stage;
+		compute::event event;
+		Profiler::Clock::time_point enqueued;
+	};
+	std::vector<PendingEvent> pending_events;
+	/// Keeps the event for the profiler, if there is one. `enqueued` is the host time the command
+	/// was enqueued at, taken before the call for blocking commands.
+	void record_event(
+		const char *stage, const compute::event &event,
+		Profiler::Clock::time_point enqueued = Profiler::Clock::now()
+	);
+	/// Hands the completed events to the profiler
+	void report_events();
+
+	/// Host copies of the buffers used by the denoiser
+	std::vector<glm::vec4> host_canvas;
+	std::vector<glm::vec4> host_albedo;
+	std::vector<glm::vec4> host_normals;
+	std::vector<float> host_depth;
+	std::vector<glm::vec4> host_denoised;
+	std::vector<cl_uint4> host_cost;
+
+	size_t canvas_size() const;
+
+	/// Allocates the canvas, output and depth buffers for the current resolution
+	void allocate_targets();
+	/// Shape types present in the last scene, indexed by ShapeType
+	bool scene_has_shape[3] = {false, false, false};
+	/// Wether the material table is too large for the constant memory of the device
+	bool materials_global = false;
+	/// Wether the last texture atlas had any texture
+	bool scene_has_textures = false;
+	/// Wether the meshes of the last scene were too large for `geometry_budget`, and are paged
+	bool geometry_paged = false;
+	/// Meshes and triangle count `buffer_triangles` was quantized for, empty if it isn't compressed
+	std::vector<MeshRange> compressed_meshes;
+	size_t compressed_triangles = 0;
+
+	/// Points the kernel arguments to the current buffers
+	void bind_arguments();
+
+	/// Build options removing the features the scene and settings don't use
+	std::string build_options() const;
+	/// Compiles the variant if it isn't cached, and switches the kernels to it
+	void use_variant(const std::string &build_options);
+	/// Loads the program from the binary cache, or builds it from source and caches it
+	compute::program build_program(const std::string &build_options);
+
+	/// Reads `count` canvas pixels starting at `first` as float4, whatever the canvas precision
+	void read_canvas_pixels(size_t first, size_t count, glm::vec4 *output);
+
+	/// Reads back the cost counters of the band and sums them into `band_cost`
+	void read_cost();
+	/// Reads back the cost of every device and sets the heatmap scale of each to their maximum,
+	/// once the frames of all of them are enqueued
+	void scale_heatmap();
+	/// Draws the heatmap of the band into the output, scaled by `heatmap_scale`
+	void draw_heatmap();
+
+	/// Reads back the canvas and AOVs of the band, filters them and uploads the result to
+	/// `denoised_canvas`
+	void denoise_canvas();
+
+	/// Clears the canvas of this device only
+	void reset_canvas();
+
+	/// Enqueues the rendering of this tracer's band, up to `frame_event`
+	void enqueue_frame(cl_uint ticks_stopped);
+	/// Denoises or draws the heatmap of the frame enqueued last, which blocks until it is rendered,
+	/// and enqueues its tonemapping and an asynchronous readback into `output`
+	void finish_frame(std::vector<uint8_t> &output);
+	/// Renders on every device at once and measures their throughput
+	void render_split(cl_uint ticks_stopped, std::vector<uint8_t> &output);
+	/// Splits the rows between the devices proportionally to their throughput
+	void balance_bands();
+	/// Copies the user facing settings to a secondary tracer
+	void sync_settings(Tracer &peer) const;
+
   public:
     struct RenderData {
         cl_int width, height;
         cl_int num_samples;
         cl_int num_bounces;
+        cl_int downscale;
+        cl_int sampler;
         cl_float aspect_ratio;
 		cl_float fov_scale;
 		bool show_normals;
+		/// Tonemap in the render kernel, skipping the `average` pass
+		bool fuse_tonemap;
+		/// Accumulate the means in half precision, the sample counts stay 32 bit integers. Past
+		/// 256 samples the mean becomes an exponential moving average over about that many
+		/// samples, since smaller steps would be lost to the rounding of a half.
+		bool half_canvas;
+		/// Write the albedo and normal AOVs, set by the tracer when denoising
+		bool write_aovs;
 
 		alignas(cl_float4) glm::mat4 camera_to_world;
 
         cl_uint time;
         cl_uint tick;
+        /// Set by the tracer, number of frames accumulated since the last clear
+        cl_uint frame;
 
         RenderData(int width, int height) {
             this->width = width;
             this->height = height;
 			this->num_samples = 4;
 			this->num_bounces = 10;
+			this->downscale = 1;
+			this->sampler = SAMPLER_SOBOL;
+			this->fuse_tonemap = true;
+			this->half_canvas = false;
+			this->write_aovs = false;
+			this->camera_to_world = glm::mat4(1.0f);
         }
     } options;
 
     struct SceneData {
-        cl_int num_shapes;
+        cl_int num_spheres;
+        cl_int num_planes;
+        cl_int num_models;
 		cl_float sun_focus;
 		cl_float sun_intensity;
 
@@ -79,10 +321,118 @@ class Tracer {
         cl_float3 sun_direction;
     } scene_data;
 
-    Tracer(const int width, const int height);
+  private:
+	/// Settings of the frame being rendered, from `enqueue_frame` to `finish_frame`
+	RenderData frame_data = options;
+
+  public:
+
+	/// Resolution divisor used while the camera moves (1 to disable)
+	int preview_scale = 2;
+	/// Number of frames after the last movement still rendered at reduced resolution
+	cl_uint preview_frames = 1;
+
+	/// Reuse the accumulated samples of static geometry when the camera moves
+	bool reprojection = false;
+	/// Maximum number of samples kept from the history, bounds ghosting
+	float max_history = 32.0f;
+	/// Relative depth difference over which a history sample is considered disoccluded
+	float depth_tolerance = 0.05f;
+
+	/// Compile a kernel variant with `num_bounces` fixed, instead of reading it at runtime.
+	/// Every bounce count used gets its own compilation.
+	bool specialize_bounces = false;
+
+	/// Ignore `options.time` in the sampler seeds, so that they only depend on the frame index,
+	/// pixel and sample. Renders are then bit-identical across runs on the same device.
+	bool deterministic = false;
+
+	/// Replace the output with a false color image of the work done per pixel. The canvas keeps
+	/// accumulating normally.
+	bool cost_heatmap = false;
+	HeatmapMetric heatmap_metric = HEATMAP_TRIANGLE_TESTS;
+
+	/// Totals of every device, for the last frame rendered with `cost_heatmap`
+	CostTotals cost_totals() const;
+
+	/// Store the triangles of models with quantized positions and octahedral normals, half the
+	/// device memory at the cost of 16 bits of precision over the bounds of each model
+	bool compress_meshes = false;
+
+	/// Pages of the meshes resident on the device, streamed in as the frames cross them. Only
+	/// used when the triangles don't fit in `geometry_budget`.
+	GeometryCache geometry_cache;
+	/// Device memory of the triangles in bytes, larger meshes are paged by `update_scene`
+	size_t geometry_budget = (size_t)1024 << 20;
+
+	/// Wether the meshes of the last scene are paged
+	bool paged_geometry() const {
+		return geometry_paged;
+	}
+
+	/// Count the rays and intersection tests of every frame, at the cost of a reduction per
+	/// work group in the render kernel
+	bool ray_stats = false;
+
+	/// Counters of every device for the last frame, all 0 if it was rendered without `ray_stats`
+	RayStats stats() const;
+
+	/// Filter the accumulated samples before tonemapping
+	bool denoise = false;
+	Denoiser denoiser;
+
+	/// Tiles of the textures resident on the device, streamed in as the frames sample them
+	TextureCache texture_cache;
+	/// Device memory of the texture tiles in bytes, applied by `update_textures`
+	size_t texture_budget = 256 << 20;
+
+	/// Receives the device time of every stage of the frames rendered, when set.
+	/// Only this tracer's device is profiled when rendering on several.
+	Profiler *profiler = nullptr;
+
+	/// Where compiled program binaries are kept between runs (empty to disable)
+	fs::path binary_cache_dir = default_binary_cache_dir();
+
+	/// $XDG_CACHE_HOME/simple-raytracer, or ~/.cache/simple-raytracer
+	static fs::path default_binary_cache_dir();
+
+    Tracer(
+        const int width, const int height,
+        const compute::device &device = compute::system::default_device()
+    );
+
+    /// Also render on every other OpenCL device of the system. The scene is uploaded to each
+    /// device, and the image is split in bands balanced by the measured throughput of each.
+    void use_all_devices();
 
     void update_scene(const std::vector<Shape> &shapes, const std::vector<Triangle> &triangles, const std::vector<Material> &materials);
 
+	/// Uploads the textures referenced by the materials. Separate from `update_scene` since
+	/// textures are large and rarely change.
+	void update_textures(const TextureAtlas &atlas);
+
+    /// Reallocates the render targets for a new resolution, clearing the canvas
+    void resize(const int width, const int height);
+
     void clear_canvas();
+
+    /// Starts a new accumulation after a camera move. If reprojection is enabled, the next
+    /// `render` merges the samples of the previous camera position instead of discarding them.
+    /// Call this before updating `options.camera_to_world`.
+    void reproject();
+
+    /// Restricts rendering to the rows [begin, end), the rest of the output is left untouched.
+    /// Not available when rendering on several devices, which manage their own bands.
+    void set_band(int begin, int end);
+
+    /// Sets the index of the next frame in the sample sequences, so that separate tracers
+    /// accumulating the same pixels draw different samples
+    void seek(cl_uint frame);
+
+    /// Reads back the running mean (xyz) and sample count (w) of the pixels of the band
+    void read_canvas(std::vector<glm::vec4> &canvas);
+
+    /// Accumulates a new frame into the canvas and reads back the tonemapped result.
+    /// @param ticks_stopped Number of frames since the camera last moved, starting at 1
     void render(cl_uint ticks_stopped, std::vector<uint8_t> &output);
 };
@@ -0,0 +1,225 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "scenes.hpp"
+#include "tracer.hpp"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+/// Measurements of one scene
+struct Result {
+	std::string scene;
+	size_t num_shapes;
+	size_t num_triangles;
+	/// Time taken by `update_scene` and `update_textures`
+	double upload_ms;
+	/// Time from the first `render` call to the pixels being on the host, including compiling
+	/// the kernel variant of the scene
+	double first_pixel_ms;
+	/// Average time of the following frames
+	double frame_ms;
+	double samples_per_second;
+	/// Rays traced by the timed frames, counted in a separate pass
+	cl_ulong rays;
+	double rays_per_second;
+};
+
+static double milliseconds_since(std::chrono::steady_clock::time_point start) {
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+static std::string json_string(const std::string &value) {
+	std::string escaped = "\"";
+	for (char c : value) {
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+		}
+		if ((unsigned char)c >= 0x20) {
+			escaped += c;
+		}
+	}
+	return escaped + "\"";
+}
+
+static void print_usage() {
+	std::cerr << "Usage: tracer-bench [--size WxH] [--samples N] [--bounces N] [--frames N]\n"
+	             "                    [--scenes NAME,NAME...] [--mesh FILE] [--compress-meshes]\n"
+	             "                    [--output FILE]\n";
+}
+
+int main(int argc, char **argv) {
+	int width = 320;
+	int height = 180;
+	int num_samples = 4;
+	int num_bounces = 10;
+	int frames = 16;
+	std::vector<std::string> scene_names = scenes::names();
+	fs::path mesh_file;
+	bool compress_meshes = false;
+	std::optional<size_t> geometry_budget;
+	fs::path output = "bench.json";
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		try {
+			if (arg == "--size" && has_value) {
+				std::string size = argv[++i];
+				width = std::stoi(size);
+				height = std::stoi(size.substr(size.find('x') + 1));
+			} else if (arg == "--samples" && has_value) {
+				num_samples = std::stoi(argv[++i]);
+			} else if (arg == "--bounces" && has_value) {
+				num_bounces = std::stoi(argv[++i]);
+			} else if (arg == "--frames" && has_value) {
+				frames = std::stoi(argv[++i]);
+			} else if (arg == "--scenes" && has_value) {
+				scene_names.clear();
+				std::stringstream list(argv[++i]);
+				std::string name;
+				while (std::getline(list, name, ',')) {
+					scene_names.push_back(name);
+				}
+			} else if (arg == "--mesh" && has_value) {
+				mesh_file = argv[++i];
+			} else if (arg == "--compress-meshes") {
+				compress_meshes = true;
+			} else if (arg == "--geometry-budget" && has_value) {
+				geometry_budget = std::stoul(argv[++i]) << 20;
+			} else if (arg == "--output" && has_value) {
+				output = argv[++i];
+			} else {
+				print_usage();
+				return -1;
+			}
+		} catch (const std::logic_error &) {
+			// Invalid number
+			print_usage();
+			return -1;
+		}
+	}
+
+	frames = glm::max(frames, 1);
+
+	compute::device device = compute::system::default_device();
+
+	auto start = std::chrono::steady_clock::now();
+	Tracer tracer(width, height, device);
+	double setup_ms = milliseconds_since(start);
+
+	// Every run traces the same paths, so timings only vary with the device
+	tracer.deterministic = true;
+	tracer.preview_scale = 1;
+	tracer.compress_meshes = compress_meshes;
+	if (geometry_budget) {
+		tracer.geometry_budget = *geometry_budget;
+	}
+
+	std::vector<uint8_t> pixels(width * height * 4);
+	std::vector<Result> results;
+
+	for (auto &name : scene_names) {
+		std::optional<SceneDescription> scene =
+			name == "mesh" ? scenes::mesh(mesh_file) : scenes::by_name(name);
+		if (!scene) {
+			std::cerr << "Unknown scene " << name << '\n';
+			return -1;
+		}
+		std::cerr << "Benchmarking " << name << '\n';
+
+		Result result;
+		result.scene = name;
+		result.num_shapes = scene->shapes.size();
+		result.num_triangles = scene->triangles.size();
+
+		tracer.options = Tracer::RenderData(width, height);
+		tracer.options.num_samples = num_samples;
+		tracer.options.num_bounces = num_bounces;
+		tracer.options.show_normals = false;
+		tracer.options.time = 0;
+		tracer.options.tick = 0;
+		scene->apply_camera(tracer.options);
+		scenes::default_sky(tracer.scene_data);
+
+		start = std::chrono::steady_clock::now();
+		tracer.update_scene(scene->shapes, scene->triangles, scene->materials);
+		tracer.update_textures(scene->textures);
+		result.upload_ms = milliseconds_since(start);
+
+		tracer.clear_canvas();
+
+		start = std::chrono::steady_clock::now();
+		tracer.render(1, pixels);
+		result.first_pixel_ms = milliseconds_since(start);
+
+		start = std::chrono::steady_clock::now();
+		for (int frame = 0; frame < frames; frame++) {
+			tracer.render(frame + 2, pixels);
+		}
+		double total_ms = milliseconds_since(start);
+
+		result.frame_ms = total_ms / frames;
+		double samples = (double)width * height * num_samples * frames;
+		result.samples_per_second = samples / (total_ms / 1000.0);
+
+		// Count the rays of the same frames again, so the reduction isn't part of the timings
+		tracer.ray_stats = true;
+		tracer.clear_canvas();
+		tracer.render(1, pixels);
+		result.rays = 0;
+		for (int frame = 0; frame < frames; frame++) {
+			tracer.render(frame + 2, pixels);
+			result.rays += tracer.stats().rays();
+		}
+		tracer.ray_stats = false;
+		result.rays_per_second = result.rays / (total_ms / 1000.0);
+
+		results.push_back(result);
+	}
+
+	std::ofstream file(output);
+	if (file.fail()) {
+		std::cerr << "Could not write " << output << '\n';
+		return -1;
+	}
+
+	file << "{\n";
+	file << "  \"device\": " << json_string(device.name()) << ",\n";
+	file << "  \"driver\": " << json_string(device.driver_version()) << ",\n";
+	file << "  \"width\": " << width << ",\n";
+	file << "  \"height\": " << height << ",\n";
+	file << "  \"samples_per_frame\": " << num_samples << ",\n";
+	file << "  \"bounces\": " << num_bounces << ",\n";
+	file << "  \"frames\": " << frames << ",\n";
+	file << "  \"compressed_meshes\": " << (compress_meshes ? "true" : "false") << ",\n";
+	file << "  \"geometry_budget_mib\": " << (tracer.geometry_budget >> 20) << ",\n";
+	file << "  \"setup_ms\": " << setup_ms << ",\n";
+	file << "  \"scenes\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		auto &result = results[i];
+		file << "    {\n";
+		file << "      \"name\": " << json_string(result.scene) << ",\n";
+		file << "      \"shapes\": " << result.num_shapes << ",\n";
+		file << "      \"triangles\": " << result.num_triangles << ",\n";
+		file << "      \"upload_ms\": " << result.upload_ms << ",\n";
+		file << "      \"first_pixel_ms\": " << result.first_pixel_ms << ",\n";
+		file << "      \"frame_ms\": " << result.frame_ms << ",\n";
+		file << "      \"samples_per_second\": " << result.samples_per_second << ",\n";
+		file << "      \"rays\": " << result.rays << ",\n";
+		file << "      \"rays_per_second\": " << result.rays_per_second << '\n';
+		file << "    }" << (i + 1 < results.size() ? "," : "") << '\n';
+	}
+	file << "  ]\n";
+	file << "}\n";
+
+	std::cerr << "Results written to " << output << '\n';
+
+	return 0;
+}
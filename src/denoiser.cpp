@@ -0,0 +1,178 @@
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "denoiser.hpp"
+
+/// Fixed set of threads running the same job, spawning threads for every pass would cost more
+/// than filtering small images
+class Denoiser::Pool {
+  public:
+	explicit Pool(int num_threads) {
+		for (int t = 0; t < num_threads; t++) {
+			threads.emplace_back([this, t]() { work(t); });
+		}
+	}
+
+	~Pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &thread : threads) {
+			thread.join();
+		}
+	}
+
+	int size() const {
+		return threads.size();
+	}
+
+	/// Calls `fn(t)` on every thread `t` and waits for all of them to return
+	void run(const std::function<void(int)> &fn) {
+		std::unique_lock<std::mutex> lock(mutex);
+		job = &fn;
+		remaining = threads.size();
+		generation++;
+		wake.notify_all();
+		done.wait(lock, [this]() { return remaining == 0; });
+		job = nullptr;
+	}
+
+  private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(int)> *job = nullptr;
+	/// Incremented by every `run`, so each thread runs a job once
+	uint64_t generation = 0;
+	size_t remaining = 0;
+	bool stopping = false;
+
+	void work(int t) {
+		uint64_t seen = 0;
+		while (true) {
+			const std::function<void(int)> *current;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+				current = job;
+			}
+
+			(*current)(t);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--remaining == 0) {
+				done.notify_one();
+			}
+		}
+	}
+};
+
+Denoiser::Denoiser() = default;
+Denoiser::~Denoiser() = default;
+
+template <typename F> void Denoiser::parallel_rows(int height, F fn) {
+	if (!pool) {
+		pool = std::make_unique<Pool>(glm::max((int)std::thread::hardware_concurrency(), 1));
+	}
+
+	int num_threads = pool->size();
+	pool->run([&](int t) {
+		for (int y = t; y < height; y += num_threads) {
+			fn(y);
+		}
+	});
+}
+
+void Denoiser::denoise(
+	int width, int height, const std::vector<glm::vec4> &color, const std::vector<glm::vec4> &albedo,
+	const std::vector<glm::vec4> &normal, const std::vector<float> &depth,
+	std::vector<glm::vec4> &output
+) {
+	const float kernel[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f}; // B3 spline
+	const float epsilon = 1e-3f;
+
+	size_t num_pixels = (size_t)width * height;
+	ping.resize(num_pixels);
+	pong.resize(num_pixels);
+	output.resize(num_pixels);
+
+	// Demodulate albedo
+	for (size_t i = 0; i < num_pixels; i++) {
+		ping[i] = glm::vec3(color[i]) / glm::max(glm::vec3(albedo[i]), glm::vec3(epsilon));
+	}
+
+	for (int iteration = 0; iteration < iterations; iteration++) {
+		int step = 1 << iteration;
+		// The color weight gets stricter as the footprint grows
+		float color_phi = sigma_color * sigma_color / (float)step;
+		float normal_phi = sigma_normal * sigma_normal;
+
+		parallel_rows(height, [&](int y) {
+			for (int x = 0; x < width; x++) {
+				size_t p = (size_t)x + (size_t)y * width;
+
+				glm::vec3 center_color = ping[p];
+				glm::vec3 center_normal = glm::vec3(normal[p]);
+				float center_depth = depth[p];
+
+				glm::vec3 sum(0.0f);
+				float weight_sum = 0.0f;
+
+				for (int dy = -2; dy <= 2; dy++) {
+					int qy = y + dy * step;
+					if (qy < 0 || qy >= height)
+						continue;
+
+					for (int dx = -2; dx <= 2; dx++) {
+						int qx = x + dx * step;
+						if (qx < 0 || qx >= width)
+							continue;
+
+						size_t q = (size_t)qx + (size_t)qy * width;
+
+						glm::vec3 color_diff = ping[q] - center_color;
+						float w_color = std::exp(-glm::dot(color_diff, color_diff) / color_phi);
+
+						glm::vec3 normal_diff = glm::vec3(normal[q]) - center_normal;
+						float w_normal = std::exp(-glm::dot(normal_diff, normal_diff) / normal_phi);
+
+						float w_depth;
+						if (std::isinf(center_depth) || std::isinf(depth[q])) {
+							w_depth = std::isinf(center_depth) == std::isinf(depth[q]) ? 1.0f : 0.0f;
+						} else {
+							float depth_diff = std::abs(depth[q] - center_depth);
+							w_depth = std::exp(
+								-depth_diff / (sigma_depth * center_depth * step + epsilon)
+							);
+						}
+
+						float w = kernel[std::abs(dx)] * kernel[std::abs(dy)] * w_color * w_normal
+							* w_depth;
+						sum += ping[q] * w;
+						weight_sum += w;
+					}
+				}
+
+				// The center pixel always has a non zero weight
+				pong[p] = sum / weight_sum;
+			}
+		});
+
+		std::swap(ping, pong);
+	}
+
+	// Remodulate albedo, keep the sample count
+	for (size_t i = 0; i < num_pixels; i++) {
+		glm::vec3 filtered = ping[i] * glm::max(glm::vec3(albedo[i]), glm::vec3(epsilon));
+		output[i] = glm::vec4(filtered, color[i].w);
+	}
+}
@@ -0,0 +1,556 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+
+#include "farm.hpp"
+#include "parser.hpp"
+#include "scenes.hpp"
+#include "tracer.hpp"
+
+namespace farm {
+
+enum MessageType : uint32_t {
+	/// RenderData, SceneData, then the shapes, triangles, materials, textures and texels
+	MESSAGE_SCENE,
+	/// A Job to render
+	MESSAGE_JOB,
+	/// The Job, then the float4 canvas of its band
+	MESSAGE_RESULT,
+	/// No more jobs, the worker waits for the next coordinator
+	MESSAGE_DONE
+};
+
+struct MessageHeader {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+/// Rows [band_begin, band_end) accumulated over the frames [first_frame, first_frame + num_frames)
+struct Job {
+	uint32_t id;
+	int32_t band_begin;
+	int32_t band_end;
+	uint32_t first_frame;
+	uint32_t num_frames;
+};
+
+static std::runtime_error socket_error(const std::string &what) {
+	return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+static void send_all(int socket, const void *data, size_t size) {
+	const char *bytes = (const char *)data;
+	while (size > 0) {
+		ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			throw socket_error("send failed");
+		}
+		bytes += sent;
+		size -= sent;
+	}
+}
+
+static void receive_all(int socket, void *data, size_t size) {
+	char *bytes = (char *)data;
+	while (size > 0) {
+		ssize_t received = recv(socket, bytes, size, 0);
+		if (received == 0)
+			throw std::runtime_error("connection closed");
+		if (received < 0) {
+			if (errno == EINTR)
+				continue;
+			throw socket_error("receive failed");
+		}
+		bytes += received;
+		size -= received;
+	}
+}
+
+static void send_message(int socket, MessageType type, const std::vector<uint8_t> &payload) {
+	MessageHeader header = {type, 0, payload.size()};
+	send_all(socket, &header, sizeof(header));
+	send_all(socket, payload.data(), payload.size());
+}
+
+/// Largest scene accepted by a worker
+static constexpr uint64_t max_scene_size = (uint64_t)32 << 30;
+
+/// Receives a message, after checking its size against the most its type can hold so that a
+/// corrupted header can't make the receiver allocate arbitrary amounts
+/// @param max_result_size Largest result expected, 0 if results aren't expected
+static MessageType receive_message(int socket, std::vector<uint8_t> &payload, uint64_t max_result_size = 0) {
+	MessageHeader header;
+	receive_all(socket, &header, sizeof(header));
+
+	uint64_t max_size = 0;
+	if (header.type == MESSAGE_SCENE) {
+		max_size = max_scene_size;
+	} else if (header.type == MESSAGE_JOB) {
+		max_size = sizeof(Job);
+	} else if (header.type == MESSAGE_RESULT) {
+		max_size = max_result_size;
+	}
+	if (header.size > max_size)
+		throw std::runtime_error("message of " + std::to_string(header.size) + " bytes is too large");
+
+	payload.resize(header.size);
+	receive_all(socket, payload.data(), payload.size());
+	return (MessageType)header.type;
+}
+
+/// Serializes trivially copyable values as their raw bytes
+struct Writer {
+	std::vector<uint8_t> bytes;
+
+	void append(const void *data, size_t size) {
+		bytes.insert(bytes.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+	}
+
+	template <typename T> void write(const T &value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		append(&value, sizeof(T));
+	}
+
+	template <typename T> void write_vector(const std::vector<T> &values) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		write<uint64_t>(values.size());
+		append(values.data(), values.size() * sizeof(T));
+	}
+};
+
+struct Reader {
+	const std::vector<uint8_t> &bytes;
+	size_t offset = 0;
+
+	void take(void *data, size_t size) {
+		if (offset + size > bytes.size())
+			throw std::runtime_error("truncated message");
+		std::memcpy(data, bytes.data() + offset, size);
+		offset += size;
+	}
+
+	template <typename T> void read(T &value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		take(&value, sizeof(T));
+	}
+
+	/// `placeholder` fills the vector before its bytes are overwritten, for types without a
+	/// default constructor
+	template <typename T> void read_vector(std::vector<T> &values, const T &placeholder = T()) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		uint64_t count;
+		read(count);
+		if (count > (bytes.size() - offset) / sizeof(T))
+			throw std::runtime_error("truncated message");
+		values.assign(count, placeholder);
+		take(values.data(), count * sizeof(T));
+	}
+};
+
+static int listen_on(uint16_t port) {
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0)
+		throw socket_error("socket failed");
+
+	int enable = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+
+	if (bind(server, (sockaddr *)&address, sizeof(address)) < 0)
+		throw socket_error("bind on port " + std::to_string(port) + " failed");
+	if (listen(server, 1) < 0)
+		throw socket_error("listen failed");
+
+	return server;
+}
+
+/// Connects to "host:port"
+static int connect_to(const std::string &address) {
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		throw std::runtime_error("expected host:port, got " + address);
+
+	std::string host = address.substr(0, colon);
+	std::string port = address.substr(colon + 1);
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo *results;
+	int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &results);
+	if (error != 0)
+		throw std::runtime_error(address + ": " + gai_strerror(error));
+
+	int connection = -1;
+	for (addrinfo *result = results; result != nullptr; result = result->ai_next) {
+		connection = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+		if (connection < 0)
+			continue;
+		if (connect(connection, result->ai_addr, result->ai_addrlen) == 0)
+			break;
+		close(connection);
+		connection = -1;
+	}
+	freeaddrinfo(results);
+
+	if (connection < 0)
+		throw socket_error("could not connect to " + address);
+
+	// Jobs are small and latency bound
+	int enable = 1;
+	setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+	return connection;
+}
+
+/// Handles the messages of one coordinator until it is done
+static void serve(int connection, std::unique_ptr<Tracer> &tracer) {
+	std::vector<uint8_t> payload;
+	std::vector<uint8_t> pixels;
+	std::vector<glm::vec4> canvas;
+	// Read by the texture streaming of every job
+	TextureAtlas textures;
+
+	while (true) {
+		MessageType type = receive_message(connection, payload);
+		Reader reader = {payload};
+
+		if (type == MESSAGE_SCENE) {
+			Tracer::RenderData options(0, 0);
+			Tracer::SceneData scene_data;
+			std::vector<Shape> shapes;
+			std::vector<Triangle> triangles;
+			std::vector<Material> materials;
+
+			reader.read(options);
+			reader.read(scene_data);
+			reader.read_vector(shapes, Shape(0, Sphere(glm::vec3(0.0f), 0.0f)));
+			reader.read_vector(triangles);
+			reader.read_vector(materials);
+			reader.read_vector(textures.textures);
+			reader.read_vector(textures.texels);
+
+			if (!tracer) {
+				tracer = std::make_unique<Tracer>(options.width, options.height);
+			} else if (tracer->options.width != options.width || tracer->options.height != options.height) {
+				tracer->resize(options.width, options.height);
+			}
+
+			tracer->options = options;
+			tracer->scene_data = scene_data;
+			// Every frame is final, there is no camera movement to preview
+			tracer->preview_scale = 1;
+			// The same jobs give the same image, whichever worker renders them
+			tracer->deterministic = true;
+			tracer->update_scene(shapes, triangles, materials);
+			tracer->update_textures(textures);
+
+			pixels.resize((size_t)options.width * options.height * 4);
+			std::cout << "Received " << shapes.size() << " shapes and " << triangles.size()
+			          << " triangles at " << options.width << "x" << options.height << '\n';
+		} else if (type == MESSAGE_JOB) {
+			if (!tracer)
+				throw std::runtime_error("job received before the scene");
+
+			Job job;
+			reader.read(job);
+
+			tracer->set_band(job.band_begin, job.band_end);
+			tracer->clear_canvas();
+			tracer->seek(job.first_frame);
+			for (cl_uint frame = 0; frame < job.num_frames; frame++) {
+				tracer->render(frame + 1, pixels);
+			}
+			tracer->read_canvas(canvas);
+
+			Writer writer;
+			writer.write(job);
+			writer.append(canvas.data(), canvas.size() * sizeof(glm::vec4));
+			send_message(connection, MESSAGE_RESULT, writer.bytes);
+		} else if (type == MESSAGE_DONE) {
+			return;
+		} else {
+			throw std::runtime_error("unexpected message " + std::to_string(type));
+		}
+	}
+}
+
+int run_worker(uint16_t port) {
+	int server;
+	try {
+		server = listen_on(port);
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << '\n';
+		return -1;
+	}
+	std::cout << "Worker listening on port " << port << '\n';
+
+	// Kept between coordinators, so the kernel is only compiled once
+	std::unique_ptr<Tracer> tracer;
+
+	while (true) {
+		int connection = accept(server, nullptr, nullptr);
+		if (connection < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << socket_error("accept failed").what() << '\n';
+			close(server);
+			return -1;
+		}
+
+		int enable = 1;
+		setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+		try {
+			serve(connection, tracer);
+		} catch (const std::exception &e) {
+			std::cerr << "Lost the coordinator: " << e.what() << '\n';
+		}
+		close(connection);
+	}
+}
+
+/// Same curve as `tonemap` in the kernel, ARGB
+static void tonemap(glm::vec3 color, uint8_t *output) {
+	const float a = 2.51f;
+	const float b = 0.03f;
+	const float c = 2.43f;
+	const float d = 0.59f;
+	const float e = 0.14f;
+
+	color = glm::clamp((color * (color * a + b)) / (color * (color * c + d) + e), 0.0f, 1.0f);
+	color = glm::sqrt(color);
+
+	output[0] = 255;
+	output[1] = color.x * 255.0f;
+	output[2] = color.y * 255.0f;
+	output[3] = color.z * 255.0f;
+}
+
+int run_coordinator(const CoordinatorConfig &config) {
+	auto scene = scenes::by_name(config.scene);
+	if (!scene) {
+		std::cerr << "Unknown scene " << config.scene << '\n';
+		return -1;
+	}
+
+	Tracer::RenderData options(config.width, config.height);
+	options.num_samples = config.num_samples;
+	options.num_bounces = config.num_bounces;
+	options.show_normals = false;
+	options.time = 0;
+	options.tick = 0;
+	scene->apply_camera(options);
+
+	Tracer::SceneData scene_data = {};
+	scenes::default_sky(scene_data);
+
+	// The scene is serialized once and sent as is to every worker
+	Writer writer;
+	writer.write(options);
+	writer.write(scene_data);
+	writer.write_vector(scene->shapes);
+	writer.write_vector(scene->triangles);
+	writer.write_vector(scene->materials);
+	writer.write_vector(scene->textures.textures);
+	writer.write_vector(scene->textures.texels);
+
+	// Bands outermost, so the first workers get different rows
+	std::deque<Job> jobs;
+	cl_uint frames_per_job = glm::max(config.frames_per_job, 1u);
+	int band_rows = glm::max(config.band_rows, 1);
+	uint32_t num_jobs = 0;
+	for (int begin = 0; begin < config.height; begin += band_rows) {
+		for (cl_uint first = 0; first < config.frames; first += frames_per_job) {
+			jobs.push_back({
+				num_jobs++, begin, glm::min(begin + band_rows, config.height), first,
+				glm::min(frames_per_job, config.frames - first)
+			});
+		}
+	}
+
+	const std::vector<Job> jobs_by_id(jobs.begin(), jobs.end());
+
+	struct Worker {
+		std::string address;
+		int connection;
+		std::optional<Job> job;
+	};
+	std::vector<Worker> workers;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (auto &address : config.workers) {
+		try {
+			int connection = connect_to(address);
+			send_message(connection, MESSAGE_SCENE, writer.bytes);
+			workers.push_back({address, connection, std::nullopt});
+		} catch (const std::exception &e) {
+			std::cerr << "Skipping worker " << address << ": " << e.what() << '\n';
+		}
+	}
+
+	// The largest band, which bounds the size of the results
+	uint64_t max_result_size = sizeof(Job) + (uint64_t)band_rows * config.width * sizeof(glm::vec4);
+
+	// Canvas band of every job, indexed by job id
+	std::vector<std::vector<glm::vec4>> results(num_jobs);
+	std::vector<uint8_t> payload;
+	uint32_t completed = 0;
+
+	auto hand_out = [&](Worker &worker) {
+		if (jobs.empty())
+			return;
+
+		Writer job_writer;
+		job_writer.write(jobs.front());
+		worker.job = jobs.front();
+		jobs.pop_front();
+		send_message(worker.connection, MESSAGE_JOB, job_writer.bytes);
+	};
+
+	auto drop = [&](size_t index, const std::string &reason) {
+		Worker &worker = workers[index];
+		std::cerr << "Dropping worker " << worker.address << ": " << reason << '\n';
+		if (worker.job) {
+			jobs.push_front(*worker.job);
+		}
+		close(worker.connection);
+		workers.erase(workers.begin() + index);
+	};
+
+	// Also hands out the jobs requeued by dropped workers, which nobody else would pick up
+	auto hand_out_idle = [&]() {
+		for (size_t i = 0; i < workers.size();) {
+			try {
+				if (!workers[i].job) {
+					hand_out(workers[i]);
+				}
+				i++;
+			} catch (const std::exception &e) {
+				drop(i, e.what());
+			}
+		}
+	};
+
+	while (completed < num_jobs) {
+		hand_out_idle();
+
+		// Polling would wait forever if no worker has a job
+		bool busy = std::any_of(workers.begin(), workers.end(), [](const Worker &worker) {
+			return worker.job.has_value();
+		});
+		if (!busy) {
+			std::cerr << "No worker left, " << num_jobs - completed << " jobs not rendered\n";
+			return -1;
+		}
+
+		std::vector<pollfd> fds;
+		for (auto &worker : workers) {
+			fds.push_back({worker.connection, POLLIN, 0});
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << socket_error("poll failed").what() << '\n';
+			return -1;
+		}
+
+		// Backwards, so dropping a worker doesn't shift the ones left to check
+		for (size_t i = fds.size(); i-- > 0;) {
+			if (fds[i].revents == 0)
+				continue;
+
+			Worker &worker = workers[i];
+			try {
+				if (receive_message(worker.connection, payload, max_result_size) != MESSAGE_RESULT)
+					throw std::runtime_error("expected a result");
+
+				Reader reader = {payload};
+				Job job;
+				reader.read(job);
+
+				// A stale or duplicated result would overwrite the band of another job
+				if (!worker.job || job.id != worker.job->id)
+					throw std::runtime_error("result of a job it wasn't given");
+
+				const Job &sent = jobs_by_id[job.id];
+				size_t num_pixels = (size_t)(sent.band_end - sent.band_begin) * config.width;
+				results[job.id].resize(num_pixels);
+				reader.take(results[job.id].data(), num_pixels * sizeof(glm::vec4));
+
+				worker.job = std::nullopt;
+				completed++;
+				std::cout << "\rJobs " << completed << "/" << num_jobs << std::flush;
+			} catch (const std::exception &e) {
+				drop(i, e.what());
+			}
+		}
+	}
+	std::cout << '\n';
+
+	for (auto &worker : workers) {
+		try {
+			send_message(worker.connection, MESSAGE_DONE, {});
+		} catch (const std::exception &) {
+			// The image is complete, a worker leaving early doesn't matter anymore
+		}
+		close(worker.connection);
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Rendered " << config.width << "x" << config.height << " at "
+	          << config.frames * config.num_samples << " samples per pixel in " << elapsed.count()
+	          << "s on " << workers.size() << " workers\n";
+
+	// Merge the running means weighted by their sample counts, in job order so that the sums
+	// don't depend on which worker finished first
+	std::vector<glm::vec4> canvas((size_t)config.width * config.height, glm::vec4(0.0f));
+	for (uint32_t id = 0; id < num_jobs; id++) {
+		const Job &job = jobs_by_id[id];
+		const std::vector<glm::vec4> &samples = results[id];
+		size_t first_pixel = (size_t)job.band_begin * config.width;
+
+		for (size_t p = 0; p < samples.size(); p++) {
+			glm::vec4 &pixel = canvas[first_pixel + p];
+			float count = pixel.w + samples[p].w;
+			if (count > 0.0f) {
+				glm::vec3 sum = glm::vec3(pixel) * pixel.w + glm::vec3(samples[p]) * samples[p].w;
+				pixel = glm::vec4(sum / count, count);
+			}
+		}
+	}
+
+	std::vector<uint8_t> pixels(canvas.size() * 4);
+	for (size_t i = 0; i < canvas.size(); i++) {
+		tonemap(glm::vec3(canvas[i]), &pixels[i * 4]);
+	}
+	save_ppm(config.output, pixels, config.width, config.height);
+
+	return 0;
+}
+
+} // namespace farm
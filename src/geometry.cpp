@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+#include "geometry.hpp"
+#include "helper.hpp"
+
+GeometryCache::GeometryCache(const compute::context &context) {
+	buffer_bounds = compute::buffer(context, 0);
+	buffer_page_table = compute::buffer(context, 0);
+	buffer_pool = compute::buffer(context, 0);
+	buffer_feedback = compute::buffer(context, 0);
+}
+
+/// Orders `indices` so that every run of `page_triangles` forms a compact cluster, by splitting
+/// the centroids at their median along the longest axis, rounded to whole pages
+static void cluster(
+	std::vector<cl_uint>::iterator begin, std::vector<cl_uint>::iterator end,
+	const std::vector<glm::vec3> &centroids
+) {
+	size_t count = end - begin;
+	size_t num_pages = (count + GeometryCache::page_triangles - 1) / GeometryCache::page_triangles;
+	if (num_pages <= 1)
+		return;
+
+	glm::vec3 lower(INFINITY), upper(-INFINITY);
+	for (auto it = begin; it != end; ++it) {
+		lower = glm::min(lower, centroids[*it]);
+		upper = glm::max(upper, centroids[*it]);
+	}
+
+	glm::vec3 extent = upper - lower;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+	auto middle = begin + (num_pages / 2) * GeometryCache::page_triangles;
+	std::nth_element(begin, middle, end, [&](cl_uint a, cl_uint b) {
+		return centroids[a][axis] < centroids[b][axis];
+	});
+
+	cluster(begin, middle, centroids);
+	cluster(middle, end, centroids);
+}
+
+void GeometryCache::add_mesh(const Model &model, const std::vector<Triangle> &triangles) {
+	std::vector<glm::vec3> centroids(model.num_triangles);
+	for (cl_uint i = 0; i < model.num_triangles; i++) {
+		auto &triangle = triangles[model.triangle_index + i];
+		centroids[i] = (triangle.vertices[0].pos + triangle.vertices[1].pos + triangle.vertices[2].pos) / 3.0f;
+	}
+
+	std::vector<cl_uint> order(model.num_triangles);
+	std::iota(order.begin(), order.end(), 0);
+	cluster(order.begin(), order.end(), centroids);
+
+	// Covers the quantization of compressed meshes, and keeps pages lying in an axis aligned
+	// plane from having empty bounds
+	glm::vec3 extent = model.local_max - model.local_min;
+	glm::vec3 padding(glm::max(extent.x, glm::max(extent.y, extent.z)) / 65535.0f);
+
+	size_t triangle_size = compressed ? sizeof(PackedTriangle) : sizeof(Triangle);
+	meshes[model.triangle_index] = {(cl_uint)pages.size(), 0};
+	Mesh &mesh = meshes[model.triangle_index];
+
+	for (size_t first = 0; first < order.size(); first += page_triangles) {
+		Page page = {glm::vec3(INFINITY), glm::vec3(-INFINITY), 0};
+		page.num_triangles = std::min(page_triangles, order.size() - first);
+
+		size_t offset = page_data.size();
+		page_data.resize(offset + page_size, 0);
+
+		for (cl_uint i = 0; i < page.num_triangles; i++) {
+			auto &triangle = triangles[model.triangle_index + order[first + i]];
+			for (auto &vertex : triangle.vertices) {
+				page.local_min = glm::min(page.local_min, vertex.pos);
+				page.local_max = glm::max(page.local_max, vertex.pos);
+			}
+
+			uint8_t *destination = &page_data[offset + i * triangle_size];
+			if (compressed) {
+				PackedTriangle packed(triangle, model.local_min, model.local_max);
+				std::memcpy(destination, &packed, sizeof(packed));
+			} else {
+				std::memcpy(destination, &triangle, sizeof(triangle));
+			}
+		}
+
+		page.local_min -= padding;
+		page.local_max += padding;
+		pages.push_back(page);
+		mesh.num_pages++;
+	}
+}
+
+void GeometryCache::reset(
+	const std::vector<Shape> &shapes, const std::vector<Triangle> &triangles, bool compress,
+	size_t budget, compute::command_queue &queue
+) {
+	// Instances of a mesh share its pages, and its bounds for the quantization
+	std::vector<std::pair<cl_uint, cl_uint>> ranges;
+	std::vector<const Model *> unique_models;
+	for (auto &shape : shapes) {
+		if (shape.type != SHAPE_MODEL)
+			continue;
+
+		auto &model = shape.shape.model;
+		std::pair<cl_uint, cl_uint> range = {model.triangle_index, model.num_triangles};
+		if (std::find(ranges.begin(), ranges.end(), range) == ranges.end()) {
+			ranges.push_back(range);
+			unique_models.push_back(&model);
+		}
+	}
+
+	if (ranges == layout && compress == compressed && budget == layout_budget && !pages.empty())
+		return;
+
+	// Uploads of the previous pages read from `page_data`
+	queue.finish();
+
+	layout = ranges;
+	compressed = compress;
+	layout_budget = budget;
+	page_size = page_triangles * (compress ? sizeof(PackedTriangle) : sizeof(Triangle));
+
+	meshes.clear();
+	pages.clear();
+	page_data.clear();
+	for (auto model : unique_models) {
+		add_mesh(*model, triangles);
+	}
+
+	// The pool is a single allocation, which the device may limit below the budget
+	auto device = queue.get_device();
+	size_t max_alloc = device.get_info<cl_ulong>(CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+	size_t num_slots = std::min(budget, max_alloc) / page_size;
+	if (num_slots == 0 && !pages.empty()) {
+		throw std::runtime_error(
+			"geometry budget of " + std::to_string(budget >> 20) + " MiB can't hold a single page"
+		);
+	}
+	num_slots = std::min(num_slots, pages.size());
+
+	page_table.assign(pages.size(), not_resident);
+	slots.assign(num_slots, Slot());
+	feedback.assign(pages.size(), 0);
+	num_resident = 0;
+	num_missing = 0;
+	too_small = false;
+
+	if (pages.empty())
+		return;
+
+	auto context = queue.get_context();
+	buffer_pool = compute::buffer(context, page_size * num_slots);
+	buffer_page_table = compute::buffer(context, sizeof(cl_uint) * page_table.size());
+	buffer_feedback = compute::buffer(context, feedback.size());
+	queue.enqueue_fill_buffer(buffer_feedback, &feedback[0], 1, 0, feedback.size());
+
+	// Fill the pool up front, everything is resident when the meshes fit in the budget
+	for (cl_uint slot = 0; slot < num_slots; slot++) {
+		upload(queue, slot, slot);
+	}
+	queue.enqueue_write_buffer(buffer_page_table, 0, buffer_page_table.size(), page_table.data());
+}
+
+void GeometryCache::place(std::vector<Model> &models, compute::command_queue &queue) {
+	std::vector<PageBounds> bounds;
+
+	for (auto &model : models) {
+		auto it = meshes.find(model.triangle_index);
+		if (it == meshes.end()) {
+			model.first_page = 0;
+			model.num_pages = 0;
+			continue;
+		}
+
+		model.first_page = bounds.size();
+		model.num_pages = it->second.num_pages;
+
+		// Same conservative bounds as Model::compute_bounding_box, for each page
+		for (cl_uint p = 0; p < it->second.num_pages; p++) {
+			cl_uint index = it->second.first_page + p;
+			const Page &page = pages[index];
+
+			glm::vec3 lower(INFINITY), upper(-INFINITY);
+			for (int i = 0; i < 8; i++) {
+				glm::vec3 corner = {
+					i & 1 ? page.local_max.x : page.local_min.x,
+					i & 2 ? page.local_max.y : page.local_min.y,
+					i & 4 ? page.local_max.z : page.local_min.z,
+				};
+
+				auto vertex = transform_vec3(model.transform, corner, true);
+				lower = glm::min(lower, vertex);
+				upper = glm::max(upper, vertex);
+			}
+
+			PageBounds entry = {{{lower.x, lower.y, lower.z, 0.0f}}, {{upper.x, upper.y, upper.z, 0.0f}}};
+			std::memcpy(&entry.bounds_min.s[3], &index, sizeof(cl_uint));
+			std::memcpy(&entry.bounds_max.s[3], &page.num_triangles, sizeof(cl_uint));
+			bounds.push_back(entry);
+		}
+	}
+
+	if (bounds.empty())
+		return;
+
+	size_t size = sizeof(PageBounds) * bounds.size();
+	if (buffer_bounds.size() < size) {
+		buffer_bounds = compute::buffer(queue.get_context(), size);
+	}
+	queue.enqueue_write_buffer(buffer_bounds, 0, size, bounds.data());
+}
+
+void GeometryCache::upload(compute::command_queue &queue, cl_uint page, cl_uint slot) {
+	Slot &previous = slots[slot];
+	if (previous.page != not_resident) {
+		page_table[previous.page] = not_resident;
+		num_resident--;
+	}
+
+	queue.enqueue_write_buffer_async(buffer_pool, slot * page_size, page_size, &page_data[page * page_size]);
+
+	page_table[page] = slot;
+	slots[slot] = {page, frame};
+	num_resident++;
+}
+
+void GeometryCache::stream(compute::command_queue &queue) {
+	if (page_table.empty())
+		return;
+
+	frame++;
+
+	std::vector<cl_uint> missing;
+	for (cl_uint page = 0; page < feedback.size(); page++) {
+		if (!feedback[page])
+			continue;
+
+		if (page_table[page] != not_resident) {
+			slots[page_table[page]].last_used = frame;
+		} else {
+			missing.push_back(page);
+		}
+	}
+	num_missing = missing.size();
+
+	cl_uchar zero = 0;
+	queue.enqueue_fill_buffer(buffer_feedback, &zero, 1, 0, feedback.size());
+
+	if (missing.empty()) {
+		too_small = false;
+		return;
+	}
+
+	// Least recently used first, the slots the last frame crossed are kept
+	std::vector<cl_uint> candidates;
+	for (cl_uint i = 0; i < slots.size(); i++) {
+		if (slots[i].page == not_resident || slots[i].last_used != frame) {
+			candidates.push_back(i);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(), [this](cl_uint a, cl_uint b) {
+		return slots[a].last_used < slots[b].last_used;
+	});
+
+	// When everything resident is in use, the budget is too small for a frame and the pages
+	// missing are left out
+	too_small = missing.size() > candidates.size();
+	size_t uploads = std::min({missing.size(), candidates.size(), max_uploads});
+	for (size_t i = 0; i < uploads; i++) {
+		upload(queue, missing[i], candidates[i]);
+	}
+
+	if (uploads == 0)
+		return;
+
+	// In order with the render kernel, and complete before `page_table` changes again since
+	// the frame is waited for
+	queue.enqueue_write_buffer_async(buffer_page_table, 0, buffer_page_table.size(), page_table.data());
+}
+
+void GeometryCache::read_feedback(compute::command_queue &queue) {
+	if (feedback.empty())
+		return;
+
+	queue.enqueue_read_buffer_async(buffer_feedback, 0, feedback.size(), feedback.data());
+}
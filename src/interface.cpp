@@ -97,7 +97,7 @@ bool interface::model_properties(
 
 	if (moved) {
 		model.transform = glm::translate(position) * glm::toMat4(orientation) * glm::scale(scale);
-		model.compute_bounding_box(triangles);
+		model.compute_bounding_box();
 		return true;
 	}
 	return false;
@@ -366,12 +366,85 @@ bool interface::scene_parameters(Tracer::SceneData &scene_data) {
 	return rerender;
 }
 
-bool interface::render_parameters(Tracer::RenderData &render_data, bool &render_raytracing) {
+bool interface::render_parameters(Tracer &tracer, bool &render_raytracing) {
+	auto &render_data = tracer.options;
+
 	bool rerender = false;
 	if (ImGui::BeginTabItem("Render")) {
 		ImGui::SliderInt("Samples", &render_data.num_samples, 1, 32);
 		rerender |= ImGui::SliderInt("Bounces", &render_data.num_bounces, 1, 32);
+		ImGui::Checkbox("Compile fixed bounce count", &tracer.specialize_bounces);
 		rerender |= ImGui::Checkbox("Show normals", &render_data.show_normals);
+		const char *samplers[] = {"Random", "Sobol"};
+		rerender |= ImGui::Combo("Sampler", &render_data.sampler, samplers, 2);
+		rerender |= ImGui::Checkbox("Deterministic sampling", &tracer.deterministic);
+		ImGui::Checkbox("Fuse tonemapping", &render_data.fuse_tonemap);
+		rerender |= ImGui::Checkbox("Half precision canvas", &render_data.half_canvas);
+		ImGui::SliderInt("Preview scale", &tracer.preview_scale, 1, 8);
+		ImGui::SliderInt("Preview frames", (int *)&tracer.preview_frames, 0, 30);
+		ImGui::Checkbox("Reproject on camera motion", &tracer.reprojection);
+		if (tracer.reprojection) {
+			ImGui::SliderFloat("Max history", &tracer.max_history, 1.0f, 256.0f, "%.0f");
+			ImGui::SliderFloat("Depth tolerance", &tracer.depth_tolerance, 0.001f, 0.5f);
+		}
+
+		ImGui::Checkbox("Denoise", &tracer.denoise);
+		if (tracer.denoise) {
+			auto &denoiser = tracer.denoiser;
+			ImGui::SliderInt("Iterations", &denoiser.iterations, 1, 8);
+			ImGui::SliderFloat("Color sigma", &denoiser.sigma_color, 0.01f, 10.0f, "%.3f", ImGuiSliderFlags_Logarithmic);
+			ImGui::SliderFloat("Normal sigma", &denoiser.sigma_normal, 0.01f, 2.0f);
+			ImGui::SliderFloat("Depth sigma", &denoiser.sigma_depth, 0.001f, 1.0f);
+		}
+		ImGui::Checkbox("Cost heatmap", &tracer.cost_heatmap);
+		if (tracer.cost_heatmap) {
+			const char *metrics[] = {"Shape tests", "Box tests", "Triangle tests", "Bounces"};
+			ImGui::Combo("Metric", (int *)&tracer.heatmap_metric, metrics, 4);
+
+			// Per frame, so divided by the samples per pixel
+			CostTotals totals = tracer.cost_totals();
+			float samples = glm::max((float)totals.num_pixels * render_data.num_samples, 1.0f);
+			for (int metric = 0; metric < 4; metric++) {
+				ImGui::Text(
+					"%s: %.1f per sample, %u max per pixel", metrics[metric],
+					totals.total[metric] / samples, totals.max[metric]
+				);
+			}
+		}
+		rerender |= ImGui::Checkbox("Compress meshes", &tracer.compress_meshes);
+		ImGui::Checkbox("Ray statistics", &tracer.ray_stats);
+		if (tracer.ray_stats) {
+			RayStats stats = tracer.stats();
+			ImGui::Text("Primary rays: %llu", (unsigned long long)stats.primary_rays);
+			ImGui::Text("Bounce rays: %llu", (unsigned long long)stats.bounce_rays);
+			ImGui::Text("Sky escapes: %llu", (unsigned long long)stats.sky_escapes);
+			ImGui::Text("Terminated paths: %llu", (unsigned long long)stats.terminated_paths);
+			ImGui::Text("Sphere tests: %llu", (unsigned long long)stats.sphere_tests);
+			ImGui::Text("Plane tests: %llu", (unsigned long long)stats.plane_tests);
+			ImGui::Text("Model box tests: %llu", (unsigned long long)stats.model_tests);
+			ImGui::Text("Triangle tests: %llu", (unsigned long long)stats.triangle_tests);
+			ImGui::Text("Rays per second: %.3g", stats.rays() * ImGui::GetIO().Framerate);
+		}
+
+		auto &cache = tracer.texture_cache;
+		if (cache.num_tiles() > 0) {
+			ImGui::Text(
+				"Texture tiles: %zu of %zu resident in %zu slots, %zu missing", cache.resident_tiles(),
+				cache.num_tiles(), cache.num_slots(), cache.missing_tiles()
+			);
+		}
+
+		if (tracer.paged_geometry()) {
+			auto &geometry = tracer.geometry_cache;
+			ImGui::Text(
+				"Geometry pages: %zu of %zu resident in %zu slots, %zu missing", geometry.resident_pages(),
+				geometry.num_pages(), geometry.num_slots(), geometry.missing_pages()
+			);
+			if (geometry.budget_too_small()) {
+				ImGui::TextColored(ImVec4(0.9f, 0.4f, 0.4f, 1.0f), "Geometry budget too small for a frame");
+			}
+		}
+
 		if (ImGui::Button("Rerender")) {
 			rerender = true;
 		}
@@ -464,6 +537,32 @@ bool interface::material_window(MaterialHelper &materials, std::vector<Shape> &s
 					ImGui::PopItemWidth();
 				}
 
+				auto texture_combo = [&materials](const char *label, cl_int &texture) {
+					auto &names = materials.textures.names;
+					const char *preview = texture < 0 ? "None" : names[texture].c_str();
+
+					bool changed = false;
+					if (ImGui::BeginCombo(label, preview)) {
+						if (ImGui::Selectable("None", texture < 0)) {
+							texture = -1;
+							changed = true;
+						}
+						for (cl_int t = 0; t < (cl_int)names.size(); t++) {
+							ImGui::PushID(t);
+							if (ImGui::Selectable(names[t].c_str(), texture == t)) {
+								texture = t;
+								changed = true;
+							}
+							ImGui::PopID();
+						}
+						ImGui::EndCombo();
+					}
+					return changed;
+				};
+				rerender |= texture_combo("Albedo texture", material.albedo_texture);
+				rerender |= texture_combo("Roughness texture", material.roughness_texture);
+				rerender |= texture_combo("Emission texture", material.emission_texture);
+
 				ImGui::TreePop();
 			}
 
@@ -473,6 +572,30 @@ bool interface::material_window(MaterialHelper &materials, std::vector<Shape> &s
 		if (ImGui::Button("New material")) {
 			materials.push(Material(), "Material" + std::to_string(materials.len()));
 		}
+
+		ImGui::SameLine();
+		if (ImGui::Button("Load texture")) {
+			ImGui::OpenPopup("texture");
+		}
+
+		if (ImGui::BeginPopup("texture")) {
+			static char filename[1024];
+			static bool error = false;
+			ImGui::InputText("filename", filename, 1024);
+
+			if (error) {
+				ImGui::TextColored(ImVec4(0.9f, 0.4f, 0.4f, 1.0f), "Unreadable image");
+			}
+
+			if (ImGui::Button("Load")) {
+				error = materials.textures.load(filename) < 0;
+				if (!error) {
+					ImGui::CloseCurrentPopup();
+				}
+			}
+
+			ImGui::EndPopup();
+		}
 	}
 	ImGui::End();
 
@@ -481,7 +604,7 @@ bool interface::material_window(MaterialHelper &materials, std::vector<Shape> &s
 
 void interface::frame_time_window(
 	std::deque<float> &frame_times, int &num_frame_samples, bool &limit_fps, int &fps_limit,
-	bool &log_fps
+	bool &log_fps, Profiler &profiler
 ) {
 	if (ImGui::Begin("Frame times")) {
 		ImGui::PlotLines(
@@ -522,6 +645,30 @@ void interface::frame_time_window(
 
 		ImGui::Checkbox("Log FPS (Console)", &log_fps);
 
+		if (ImGui::CollapsingHeader("Stages")) {
+			// Device stages overlap the host ones, they are timed with OpenCL events
+			for (auto &stage : profiler.stages()) {
+				ImGui::PushID(stage.name.c_str());
+				ImGui::Text(
+					"%s%s: %.3f ms", stage.device ? ICON_FA_MICROCHIP " " : "", stage.name.c_str(),
+					stage.average()
+				);
+				ImGui::PlotLines(
+					"##history", stage.history.data(), stage.history.size(), profiler.offset(), NULL,
+					0.0f, FLT_MAX, ImVec2(0.0f, 40.0f)
+				);
+				ImGui::PopID();
+			}
+		}
+
+		static int trace_frames = 10;
+		ImGui::SliderInt("Trace frames", &trace_frames, 1, 300);
+		if (profiler.capturing()) {
+			ImGui::Text("Capturing...");
+		} else if (ImGui::Button("Capture Chrome trace")) {
+			profiler.capture(trace_frames, "trace.json");
+		}
+
 		static bool demo_window = false;
 		ImGui::Checkbox("Show demo window", &demo_window);
 		if (demo_window) {
@@ -2,7 +2,9 @@
 #include <cstdint>
 #include <functional>
 #include <iostream>
+#include <optional>
 #include <random>
+#include <sstream>
 
 #include <vector>
 
@@ -30,29 +32,122 @@
 #include <SDL2/SDL.h>
 
 #include "color.hpp"
+#include "farm.hpp"
 #include "helper.hpp"
 #include "interface.hpp"
 #include "parser.hpp"
+#include "profiler.hpp"
+#include "scenes.hpp"
 #include "shape.hpp"
 #include "tracer.hpp"
 
+#include "font_awesome_ttf.h"
+
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
 #define WINDOW_WIDTH 960
 #define WINDOW_HEIGHT 540
 
-#define RENDER_WIDTH (WINDOW_WIDTH)
-#define RENDER_HEIGHT (WINDOW_HEIGHT)
-
 double now() {
 	return std::chrono::high_resolution_clock::now().time_since_epoch().count() / 1'000'000'000.0;
 }
 
-int main(int argc, char **) {
-	if (argc != 1) {
-		printf("Usage: tracer");
-		return -1;
+static void print_usage() {
+	printf(
+		"Usage: tracer [--multi-device] [--deterministic] [--trace FRAMES] [--texture-budget MIB]\n"
+		"              [--geometry-budget MIB]\n"
+		"       tracer --worker PORT\n"
+		"       tracer --coordinator HOST:PORT[,HOST:PORT...] [--scene NAME] [--size WxH]\n"
+		"              [--samples N] [--bounces N] [--frames N] [--frames-per-job N]\n"
+		"              [--band-rows N] [--output FILE]\n"
+	);
+}
+
+/// Splits "a,b,c"
+static std::vector<std::string> split_list(const std::string &list) {
+	std::vector<std::string> items;
+	std::stringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		if (!item.empty())
+			items.push_back(item);
+	}
+	return items;
+}
+
+int main(int argc, char **argv) {
+	bool multi_device = false;
+	bool deterministic = false;
+	int trace_frames = 0;
+	std::optional<size_t> texture_budget;
+	std::optional<size_t> geometry_budget;
+	std::optional<int> worker_port;
+	bool coordinator = false;
+	farm::CoordinatorConfig farm_config;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		try {
+			if (arg == "--multi-device") {
+				multi_device = true;
+			} else if (arg == "--deterministic") {
+				deterministic = true;
+			} else if (arg == "--trace" && has_value) {
+				trace_frames = std::stoi(argv[++i]);
+			} else if (arg == "--texture-budget" && has_value) {
+				texture_budget = std::stoul(argv[++i]) << 20;
+			} else if (arg == "--geometry-budget" && has_value) {
+				geometry_budget = std::stoul(argv[++i]) << 20;
+			} else if (arg == "--worker" && has_value) {
+				worker_port = std::stoi(argv[++i]);
+				if (*worker_port < 1 || *worker_port > 65535)
+					throw std::out_of_range("port");
+			} else if (arg == "--coordinator" && has_value) {
+				coordinator = true;
+				farm_config.workers = split_list(argv[++i]);
+			} else if (arg == "--scene" && has_value) {
+				farm_config.scene = argv[++i];
+			} else if (arg == "--size" && has_value) {
+				std::string size = argv[++i];
+				size_t separator = size.find('x');
+				if (separator == std::string::npos)
+					throw std::invalid_argument("size");
+				farm_config.width = std::stoi(size);
+				farm_config.height = std::stoi(size.substr(separator + 1));
+				if (farm_config.width <= 0 || farm_config.height <= 0)
+					throw std::out_of_range("size");
+			} else if (arg == "--samples" && has_value) {
+				farm_config.num_samples = std::stoi(argv[++i]);
+			} else if (arg == "--bounces" && has_value) {
+				farm_config.num_bounces = std::stoi(argv[++i]);
+			} else if (arg == "--frames" && has_value) {
+				farm_config.frames = std::stoul(argv[++i]);
+			} else if (arg == "--frames-per-job" && has_value) {
+				farm_config.frames_per_job = std::stoul(argv[++i]);
+			} else if (arg == "--band-rows" && has_value) {
+				farm_config.band_rows = std::stoi(argv[++i]);
+			} else if (arg == "--output" && has_value) {
+				farm_config.output = argv[++i];
+			} else {
+				print_usage();
+				return -1;
+			}
+		} catch (const std::logic_error &) {
+			// Invalid number, or out of range
+			print_usage();
+			return -1;
+		}
+	}
+
+	// The farm modes are headless
+	if (worker_port) {
+		return farm::run_worker(*worker_port);
+	}
+	if (coordinator) {
+		return farm::run_coordinator(farm_config);
 	}
 
 	SDL_Renderer *renderer;
@@ -83,13 +178,21 @@ int main(int argc, char **) {
 	ImFontConfig config;
 	config.MergeMode = true;
 	config.GlyphMinAdvanceX = 13.0f;
+	config.FontDataOwnedByAtlas = false; // embedded in the executable
 	static const ImWchar icon_ranges[] = { ICON_MIN_FA, ICON_MAX_FA, 0 };
-	io.Fonts->AddFontFromFileTTF("assets/font_awesome.ttf", 13.0f, &config, icon_ranges);
+	io.Fonts->AddFontFromMemoryTTF(
+		(void *)embedded::font_awesome_ttf, sizeof(embedded::font_awesome_ttf), 13.0f, &config,
+		icon_ranges
+	);
 
 	interface::GuizmoHelper guizmos;
 
+	// Render at the native resolution of the window
+	int render_width, render_height;
+	SDL_GetRendererOutputSize(renderer, &render_width, &render_height);
+
 	SDL_Texture *texture = SDL_CreateTexture(
-		renderer, SDL_PIXELFORMAT_ARGB32, SDL_TEXTUREACCESS_STREAMING, RENDER_WIDTH, RENDER_HEIGHT
+		renderer, SDL_PIXELFORMAT_ARGB32, SDL_TEXTUREACCESS_STREAMING, render_width, render_height
 	);
 
 	std::vector<Shape> shapes;
@@ -106,26 +209,36 @@ int main(int argc, char **) {
 	Camera camera = {{0.0f, 0.0f, 5.0f}, 0.0f, 0.0f};
 	glm::mat4 camera_mat;
 
-	float aspect_ratio = static_cast<float>(RENDER_WIDTH) / RENDER_HEIGHT;
+	float aspect_ratio = static_cast<float>(render_width) / render_height;
 
 	float fov = glm::pi<float>() / 2.f; // 90 degrees
 	float fov_scale = glm::tan(fov / 2.f);
 
-	Tracer tracer(RENDER_WIDTH, RENDER_HEIGHT);
+	Profiler profiler;
+	if (trace_frames > 0) {
+		profiler.capture(trace_frames, "trace.json");
+	}
+
+	Tracer tracer(render_width, render_height);
+	tracer.profiler = &profiler;
+	if (multi_device) {
+		tracer.use_all_devices();
+	}
+	tracer.deterministic = deterministic;
+	if (texture_budget) {
+		tracer.texture_budget = *texture_budget;
+	}
+	if (geometry_budget) {
+		tracer.geometry_budget = *geometry_budget;
+	}
 
 	tracer.options.num_samples = 2;
 	tracer.options.num_bounces = 10;
 	tracer.options.show_normals = false;
 
-	tracer.scene_data.horizon_color = color::from_hex(0x374F62);
-	tracer.scene_data.zenith_color = color::from_hex(0x11334A);
-	tracer.scene_data.ground_color = color::from_hex(0x777777);
-	tracer.scene_data.sun_focus = 25.0f;
-	tracer.scene_data.sun_color = color::from_hex(0xffffd3);
-	tracer.scene_data.sun_intensity = 1.0f;
-	tracer.scene_data.sun_direction = VEC3TOCL(glm::normalize(glm::vec3(1.0, -1.0, 0.0)));
+	scenes::default_sky(tracer.scene_data);
 
-	std::vector<uint8_t> pixels(RENDER_WIDTH * RENDER_HEIGHT * 4);
+	std::vector<uint8_t> pixels(render_width * render_height * 4);
 
 	// SDL state
 	bool running = true;
@@ -138,6 +251,8 @@ int main(int argc, char **) {
 	// Other state
 	int tick = 0;
 	cl_uint time_not_moved = 1;
+	// Textures are only ever added, so their count tells when to upload them again
+	size_t uploaded_textures = 0;
 	double average = 0.0;
 	float delta_time = 0.0;
 
@@ -158,6 +273,7 @@ int main(int argc, char **) {
 	while (running) {
 		double start = now();
 
+		profiler.begin("Events");
 		while (SDL_PollEvent(&event) != 0) {
 			ImGui_ImplSDL2_ProcessEvent(&event);
 
@@ -179,6 +295,25 @@ int main(int argc, char **) {
 			case SDL_QUIT:
 				running = false;
 				break;
+			case SDL_WINDOWEVENT:
+				if (event.window.event != SDL_WINDOWEVENT_SIZE_CHANGED)
+					break;
+
+				SDL_GetRendererOutputSize(renderer, &render_width, &render_height);
+				if (render_width <= 0 || render_height <= 0)
+					break;
+
+				SDL_DestroyTexture(texture);
+				texture = SDL_CreateTexture(
+					renderer, SDL_PIXELFORMAT_ARGB32, SDL_TEXTUREACCESS_STREAMING, render_width,
+					render_height
+				);
+				pixels.resize(render_width * render_height * 4);
+				tracer.resize(render_width, render_height);
+
+				aspect_ratio = static_cast<float>(render_width) / render_height;
+				time_not_moved = 1;
+				break;
 			case SDL_MOUSEWHEEL:
 				if (!accepting_input)
 					break;
@@ -216,6 +351,7 @@ int main(int argc, char **) {
 			}
 		}
 
+		profiler.begin("Interface");
 		bool rerender = false;
 
 		// Move camera
@@ -254,12 +390,15 @@ int main(int argc, char **) {
 				rerender |= interface::shape_parameters(
 					shapes, triangles, guizmos, materials
 				);
-				rerender |= interface::camera_parameters(
-					camera, movement_speed, look_around_speed, pixels,
-					glm::ivec2(WINDOW_WIDTH, WINDOW_HEIGHT)
-				);
+				// Only the camera changes, the samples can be reprojected
+				if (interface::camera_parameters(
+						camera, movement_speed, look_around_speed, pixels,
+						glm::ivec2(render_width, render_height)
+					)) {
+					time_not_moved = 1;
+				}
 				rerender |= interface::scene_parameters(tracer.scene_data);
-				rerender |= interface::render_parameters(tracer.options, render_raytracing);
+				rerender |= interface::render_parameters(tracer, render_raytracing);
 
 				ImGui::EndTabBar();
 			}
@@ -271,13 +410,24 @@ int main(int argc, char **) {
 			time_not_moved = 1;
 		}
 
-		interface::frame_time_window(frame_times, num_frame_samples, limit_fps, fps_limit, log_fps);
+		interface::frame_time_window(
+			frame_times, num_frame_samples, limit_fps, fps_limit, log_fps, profiler
+		);
 
 		// Handle ray tracing
+		profiler.begin("Scene update");
 		if (time_not_moved == 1) {
-			tracer.clear_canvas();
+			if (rerender) {
+				tracer.clear_canvas();
+			} else {
+				tracer.reproject(); // only the camera moved
+			}
 			tracer.update_scene(shapes, triangles, materials.materials);
 		}
+		if (materials.textures.size() != uploaded_textures) {
+			tracer.update_textures(materials.textures);
+			uploaded_textures = materials.textures.size();
+		}
 
 		if (render_raytracing) {
 			auto &options = tracer.options;
@@ -287,6 +437,7 @@ int main(int argc, char **) {
 			options.time = start * 1000;
 			options.tick = tick;
 
+			profiler.begin("Render");
 			tracer.render(time_not_moved, pixels);
 
 			int width = win_size.x;
@@ -303,7 +454,8 @@ int main(int argc, char **) {
 			SDL_RenderFillRect(renderer, &r);
 
 			// Render to screen
-			SDL_UpdateTexture(texture, NULL, pixels.data(), RENDER_WIDTH * 4);
+			profiler.begin("Texture upload");
+			SDL_UpdateTexture(texture, NULL, pixels.data(), render_width * 4);
 
 			SDL_Rect dstrect = {.x = 0, .y = target_y, .w = width, .h = target_height};
 			SDL_RenderCopy(renderer, texture, NULL, &dstrect);
@@ -317,16 +469,19 @@ int main(int argc, char **) {
 		}
 
 		if (pressed_keys[SDLK_p]) {
-			save_ppm("out.ppm", pixels, WINDOW_WIDTH, WINDOW_HEIGHT);
+			save_ppm("out.ppm", pixels, render_width, render_height);
 			pressed_keys[SDLK_p] = false;
 		}
 
 		// Render imgui output
+		profiler.begin("Present");
 		guizmos.draw();
 		ImGui::Render();
 		ImGui_ImplSDLRenderer2_RenderDrawData(ImGui::GetDrawData());
 
 		SDL_RenderPresent(renderer);
+		profiler.end();
+		profiler.end_frame();
 
 		double loop_duration = now() - start;
 		frame_times.pop_front();
@@ -352,6 +507,7 @@ int main(int argc, char **) {
 	ImGui_ImplSDL2_Shutdown();
 	ImGui::DestroyContext();
 
+	SDL_DestroyTexture(texture);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
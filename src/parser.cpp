@@ -61,10 +61,12 @@ std::optional<ModelPair> load_obj_model(const std::filesystem::path filename, st
 
 	struct Face {
 		int vertices[3];
+		int uvs[3] = {0, 0, 0};
 		int normals[3];
 	};
 
 	std::vector<glm::vec3> vertices;
+	std::vector<glm::vec2> uvs;
 	std::vector<glm::vec3> normals;
 	std::vector<Face> faces;
 
@@ -79,17 +81,20 @@ std::optional<ModelPair> load_obj_model(const std::filesystem::path filename, st
 			float x, y, z;
 			stream >> x >> y >> z;
 			vertices.push_back({x, y, z});
+		} else if (mode == "vt") { // texture coordinates
+			float u, v;
+			stream >> u >> v;
+			uvs.push_back({u, v});
 		} else if (mode == "vn") { // normal
 			float x, y, z;
 			stream >> x >> y >> z;
 			normals.push_back(glm::normalize(glm::vec3(x, y, z)));
 		} else if (mode == "f") { // face
 			Face face;
-			auto extract_index = [&stream](int &vertex, int &normal) {
+			auto extract_index = [&stream](int &vertex, int &uv, int &normal) {
 				stream >> vertex;
 				if (stream.get() == '/') {
 					if (stream.peek() != '/') {
-						int uv;
 						stream >> uv;
 					}
 
@@ -99,9 +104,9 @@ std::optional<ModelPair> load_obj_model(const std::filesystem::path filename, st
 					}
 				}
 			};
-			extract_index(face.vertices[0], face.normals[0]);
-			extract_index(face.vertices[1], face.normals[1]);
-			extract_index(face.vertices[2], face.normals[2]);
+			extract_index(face.vertices[0], face.uvs[0], face.normals[0]);
+			extract_index(face.vertices[1], face.uvs[1], face.normals[1]);
+			extract_index(face.vertices[2], face.uvs[2], face.normals[2]);
 
 			faces.push_back(face);
 		} else if (mode == "s") {
@@ -114,7 +119,7 @@ std::optional<ModelPair> load_obj_model(const std::filesystem::path filename, st
 	for (auto &face : faces) {
 		auto adjust = [](int &index, int len) {
 			if (index < 0) { // negative indices specify the end of the list
-				index = len - index + 1;
+				index = len + index + 1;
 			}
 			index -= 1; // indices are 1-based
 		};
@@ -126,6 +131,13 @@ std::optional<ModelPair> load_obj_model(const std::filesystem::path filename, st
 
 			triangle.vertices[i].pos = vertices[face.vertices[i]];
 			triangle.vertices[i].normal = normals[face.normals[i]];
+
+			// Faces without texture coordinates keep (0, 0)
+			if (face.uvs[i] != 0) {
+				adjust(face.uvs[i], uvs.size());
+				triangle.vertices[i].u = uvs[face.uvs[i]].x;
+				triangle.vertices[i].v = uvs[face.uvs[i]].y;
+			}
 		}
 
 		triangles.push_back(triangle);
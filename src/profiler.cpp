@@ -0,0 +1,116 @@
+#include <fstream>
+#include <iostream>
+
+#include "profiler.hpp"
+
+float Profiler::Stage::average() const {
+	float sum = 0.0f;
+	for (float milliseconds : history) {
+		sum += milliseconds;
+	}
+	return history.empty() ? 0.0f : sum / history.size();
+}
+
+Profiler::Profiler(size_t capacity) : frame_capacity(capacity) {
+}
+
+Profiler::Stage &Profiler::stage(const std::string &name, bool device) {
+	for (auto &stage : stage_list) {
+		if (stage.name == name)
+			return stage;
+	}
+
+	stage_list.push_back({name, device, std::vector<float>(frame_capacity, 0.0f)});
+	return stage_list.back();
+}
+
+void Profiler::record(const std::string &name, Clock::time_point start, Clock::time_point end, bool device) {
+	std::chrono::duration<float, std::milli> elapsed = end - start;
+	stage(name, device).current += elapsed.count();
+
+	if (capturing()) {
+		captured.push_back({name, device, start, end});
+	}
+}
+
+void Profiler::record(const std::string &name, const compute::event &event, Clock::time_point enqueued) {
+	// The device clock has its own origin, the queued timestamp is matched to the host time
+	auto queued = std::chrono::nanoseconds(event.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_QUEUED));
+	auto start = std::chrono::nanoseconds(event.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_START));
+	auto end = std::chrono::nanoseconds(event.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_END));
+
+	record(name, enqueued + (start - queued), enqueued + (end - queued), true);
+}
+
+void Profiler::begin(const std::string &name) {
+	end();
+	running = name;
+	running_start = Clock::now();
+}
+
+void Profiler::end() {
+	if (running.empty())
+		return;
+
+	record(running, running_start, Clock::now());
+	running.clear();
+}
+
+void Profiler::end_frame() {
+	for (auto &stage : stage_list) {
+		stage.history[next_frame] = stage.current;
+		stage.current = 0.0f;
+	}
+	next_frame = (next_frame + 1) % frame_capacity;
+
+	Clock::time_point now = Clock::now();
+	if (capturing()) {
+		captured.push_back({"Frame", false, frame_start, now});
+
+		frames_to_capture--;
+		if (frames_to_capture == 0) {
+			write_capture();
+			captured.clear();
+		}
+	}
+	frame_start = now;
+}
+
+void Profiler::capture(int frames, const fs::path &path) {
+	frames_to_capture = frames;
+	capture_path = path;
+	captured.clear();
+}
+
+void Profiler::write_capture() const {
+	std::ofstream file(capture_path);
+	if (file.fail()) {
+		std::cerr << "Could not write the trace to " << capture_path << '\n';
+		return;
+	}
+
+	Clock::time_point origin = captured.empty() ? Clock::now() : captured.front().start;
+	for (auto &span : captured) {
+		origin = std::min(origin, span.start);
+	}
+
+	auto microseconds = [](Clock::duration duration) {
+		return std::chrono::duration<double, std::micro>(duration).count();
+	};
+
+	// Complete events, the host on one thread and the device on another
+	file << "{\"traceEvents\": [\n";
+	file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+	        "\"args\": {\"name\": \"Host\"}},\n";
+	file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, "
+	        "\"args\": {\"name\": \"OpenCL device\"}}";
+	for (auto &span : captured) {
+		file << ",\n{\"name\": \"" << span.name << "\", \"cat\": \"" << (span.device ? "device" : "host")
+		     << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << (span.device ? 1 : 0)
+		     << ", \"ts\": " << microseconds(span.start - origin)
+		     << ", \"dur\": " << microseconds(span.end - span.start) << "}";
+	}
+	file << "\n]}\n";
+
+	std::cout << "Wrote a trace of " << captured.size() << " spans to " << capture_path << '\n';
+}
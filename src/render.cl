@@ -2,6 +2,21 @@
 #define NULL 0
 #endif
 
+// Specialization options, passed as build options by the tracer:
+// NO_SPHERES, NO_PLANES, NO_MODELS remove the intersection code of shapes absent from the scene,
+// NORMALS_ONLY replaces `show_normals`, NUM_BOUNCES replaces `num_bounces`.
+#ifdef NORMALS_ONLY
+#define SHOW_NORMALS_OF(render) true
+#else
+#define SHOW_NORMALS_OF(render) false
+#endif
+
+#ifdef NUM_BOUNCES
+#define NUM_BOUNCES_OF(render) NUM_BOUNCES
+#else
+#define NUM_BOUNCES_OF(render) ((render)->num_bounces)
+#endif
+
 typedef struct {
 	float3 origin;
 	float3 direction;
@@ -12,33 +27,47 @@ typedef struct {
 	float3 normal;
 	/// Checks wether the intersection happened outside the model or inside
 	bool front;
+	float2 uv;
+	/// Texture coordinate units per world unit around the intersection, to pick a mip level
+	float uv_density;
 } Intersection;
 
+/// Material as laid out by the host, with the values derived from it precomputed
 typedef struct {
-	float smoothness;
-	float metallic;
-	float specular;
-	float emission_strength;
-	float transmittance;
-	float refraction_index;
-
-	float3 color;
-	float3 emission;
+	/// Base color (xyz) and smoothness (w)
+	float4 color;
+	/// Emission scaled by its strength (xyz) and Fresnel reflectance at normal incidence (w)
+	float4 emission;
+	/// Probabilities of a metallic, specular and transmitted bounce (xyz) and refraction index (w)
+	float4 lobes;
+	/// Albedo, roughness and emission textures, -1 for none
+	int4 textures;
 } Material;
 
+/// Location of a texture and its mip levels in the page table
 typedef struct {
-	float3 position;
-	float radius;
-} Sphere;
-
-typedef struct {
-	float3 position;
-	float3 normal;
-} Plane;
+	/// Page table entry of the first tile of the full resolution level, the smaller levels follow
+	uint first_tile;
+	int width;
+	int height;
+	int num_levels;
+} Texture;
+
+/// Textures are split in square tiles, of which only some are resident in the tile pool
+#define TEXTURE_TILE_SIZE 64
+#define TILE_NOT_RESIDENT 0xFFFFFFFFU
+
+/// Small material tables are read through the constant cache, large ones from global memory
+#ifdef MATERIALS_GLOBAL
+#define MATERIAL_SPACE __global
+#else
+#define MATERIAL_SPACE __constant
+#endif
 
 typedef struct {
-	float3 normal;
-	float3 pos;
+	/// Texture coordinates are stored in the w components, u in the normal and v in the position
+	float4 normal;
+	float4 pos;
 } Vertex;
 
 typedef struct {
@@ -52,47 +81,98 @@ typedef struct {
 	};
 } Triangle;
 
+/// Vertex of a compressed mesh, 16 bytes instead of 32
+typedef struct {
+	/// Position quantized over the object space bounds of its model (xyz) and u as a half (w)
+	ushort4 position;
+	/// Octahedral normal as two snorm16 (xy) and v as a half (z)
+	ushort4 normal;
+} PackedVertex;
+
+typedef struct {
+	PackedVertex vertices[3];
+} PackedTriangle;
+
+/// Format of the triangles in device memory
+#ifdef COMPRESSED_MESHES
+typedef PackedTriangle MeshTriangle;
+#else
+typedef Triangle MeshTriangle;
+#endif
+
 typedef struct {
 	uint triangle_index;
 	uint num_triangles;
+	/// Entries of the page bounds, when the meshes are paged
+	uint first_page;
+	uint num_pages;
 	float3 bounding_min;
 	float3 bounding_max;
 	float4 transform[4];
+	float3 local_min;
+	float3 local_max;
 } Model;
 
+/// Meshes are split in pages of spatially close triangles, of which only some are resident in
+/// the triangle pool when the meshes are paged
+#define GEOMETRY_PAGE_TRIANGLES 512
+#define PAGE_NOT_RESIDENT 0xFFFFFFFFU
+
+/// World space bounds of a page for one model
+typedef struct {
+	/// Index of the page in the page table (w, as bits)
+	float4 bounds_min;
+	/// Number of triangles of the page (w, as bits)
+	float4 bounds_max;
+} PageBounds;
+
 typedef enum {
 	SHAPE_SPHERE,
 	SHAPE_PLANE,
 	SHAPE_MODEL
 } ShapeType;
 
-typedef struct {
-	ShapeType type;
-	int material;
-	union {
-		Sphere sphere;
-		Plane plane;
-		Model model;
-	} shape;
-} Shape;
-
 typedef struct {
 	int width, height;
 	int num_samples;
 	int num_bounces;
+	/// Trace one pixel out of `downscale`x`downscale` blocks and fill the whole block with it
+	int downscale;
+	/// SamplerType used for the random decisions along a path
+	int sampler;
 	float aspect_ratio;
 	float fov_scale;
 	/// For some reason, open cl refuses bools in kernel parameters?
 	char show_normals;
+	/// Tonemap directly in `render` instead of running `average` afterwards
+	char fuse_tonemap;
+	/// Store the canvas as half4 instead of float4
+	char half_canvas;
+	/// Write the first hit albedo and normal for the denoiser
+	char write_aovs;
 
 	float4 camera_to_world[4];
 
+	/// Mixed into the random sampler seed, 0 in deterministic mode
 	uint time;
 	uint tick;
+	/// Number of frames accumulated since the canvas was cleared
+	uint frame;
 } RenderData;
 
 typedef struct {
-	int num_shapes;
+	float4 world_to_camera[4];
+	float aspect_ratio;
+	float fov_scale;
+	/// Relative depth difference over which a history sample is rejected
+	float depth_tolerance;
+	float max_history;
+} ReprojectionData;
+
+typedef struct {
+	int num_spheres;
+	int num_planes;
+	int num_models;
 	float sun_focus;
 	float sun_intensity;
 
@@ -104,11 +184,62 @@ typedef struct {
 	float3 sun_direction;
 } SceneData;
 
+/// Information about the first intersection of a camera ray, used for reprojection and denoising
+typedef struct {
+	/// INFINITY if the camera ray escapes
+	float depth;
+	float3 normal;
+	float3 albedo;
+	/// Set when the path ran into geometry that isn't resident, its sample is dropped
+	bool missing_geometry;
+} FirstHit;
+
+/// Work done to trace a pixel, only counted when COST_HEATMAP or RAY_STATS is defined
+typedef struct {
+	uint paths;
+	/// Calls to `closest_intersection`, the primary ray included
+	uint rays;
+	/// Paths that ended in the sky, the others ran out of bounces
+	uint sky_escapes;
+	uint sphere_tests;
+	uint plane_tests;
+	/// Model bounding box tests
+	uint aabb_tests;
+	uint triangle_tests;
+} Cost;
+
+#if defined(COST_HEATMAP) || defined(RAY_STATS)
+#define COUNT_COST(counter) ((counter)++)
+#else
+#define COUNT_COST(counter)
+#endif
+
+/// Number of 64 bit totals in the stats buffer, in the order of the fields of Cost
+#define NUM_RAY_STATS 7
+
 typedef struct {
 	const SceneData *data;
-	__global const Shape *shapes;
-	__global const Triangle *triangles;
-	__global const Material *materials;
+	/// Center (xyz) and radius (w)
+	__global const float4 *spheres;
+	/// Normal (xyz) and distance to the origin along the normal (w)
+	__global const float4 *planes;
+	__global const Model *models;
+	/// Material of every sphere, then every plane, then every model
+	__global const int *shape_materials;
+	__global const MeshTriangle *triangles;
+	MATERIAL_SPACE const Material *materials;
+	__global const Texture *textures;
+	/// Slot of the tile pool holding each tile, or TILE_NOT_RESIDENT
+	__global const uint *page_table;
+	__global const uchar4 *tile_pool;
+	/// Set for every tile sampled, so the host can stream in the missing ones and keep the others
+	__global uchar *feedback;
+	/// Bounds of the pages of every model, the triangles are then the pool of resident pages
+	__global const PageBounds *page_bounds;
+	/// Slot of the triangle pool holding each page, or PAGE_NOT_RESIDENT
+	__global const uint *geometry_page_table;
+	/// Set for every page whose bounds a ray crosses
+	__global uchar *geometry_feedback;
 } Scene;
 
 float4 matrix_by_vector(__generic const float4 *m, const float4 v) {
@@ -147,19 +278,134 @@ float random_float(uint *seed) {
 	return (float)result / (float)UINT_MAX;
 }
 
-inline float random_float_normal(uint *seed) {
-	float theta = 2 * M_PI_F * random_float(seed);
-	float rho = sqrt(-2.0f * log(random_float(seed)));
-	return rho * cos(theta);
+/// Integer hash (lowbias32)
+inline uint hash(uint x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint hash_combine(uint seed, uint v) {
+	return seed ^ (v + 0x9e3779b9U + (seed << 6) + (seed >> 2));
 }
 
-inline float3 random_direction(uint *seed) {
-	return normalize((float3)(random_float_normal(seed), random_float_normal(seed), random_float_normal(seed)));
+inline uint reverse_bits(uint x) {
+	x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+	x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+	x = ((x >> 4) & 0x0F0F0F0FU) | ((x & 0x0F0F0F0FU) << 4);
+	x = ((x >> 8) & 0x00FF00FFU) | ((x & 0x00FF00FFU) << 8);
+	return (x >> 16) | (x << 16);
 }
 
-inline float3 random_direction_hemisphere(float3 normal, uint *seed) {
-	float3 dir = random_direction(seed);
-	return dir * sign(dot(normal, dir));
+/// Hash based Owen scrambling, see Burley 2020, "Practical Hash-based Owen Scrambling"
+inline uint nested_uniform_scramble(uint x, uint seed) {
+	x = reverse_bits(x);
+	// Laine-Karras permutation
+	x += seed;
+	x ^= x * 0x6c50b47cU;
+	x ^= x * 0xb82f1e52U;
+	x ^= x * 0xc7afe638U;
+	x ^= x * 0x8d22f6e6U;
+	return reverse_bits(x);
+}
+
+/// First two dimensions of the Sobol sequence
+inline uint2 sobol_2d(uint index) {
+	uint x = reverse_bits(index); // Van der Corput
+
+	uint y = 0;
+	for (uint v = 1U << 31; index != 0; index >>= 1, v ^= v >> 1) {
+		if (index & 1)
+			y ^= v;
+	}
+
+	return (uint2)(x, y);
+}
+
+typedef enum {
+	SAMPLER_RANDOM,
+	SAMPLER_SOBOL
+} SamplerType;
+
+/// Source of the random numbers of one path
+typedef struct {
+	SamplerType type;
+	/// Per pixel scramble for Sobol, rng state for random
+	uint seed;
+	/// Index of the path in the sequence of its pixel
+	uint index;
+	/// Next dimension pair to draw
+	uint dimension;
+} Sequence;
+
+Sequence sequence_init(const RenderData *data, uint pixel, uint sample) {
+	Sequence seq;
+	seq.type = data->sampler;
+	seq.dimension = 0;
+	seq.index = data->frame * data->num_samples + sample;
+
+	if (seq.type == SAMPLER_SOBOL) {
+		seq.seed = hash(pixel);
+	} else {
+		// `time` is 0 in deterministic mode, the frame alone keeps successive frames apart
+		uint seed = hash_combine(hash_combine(hash(pixel), sample), data->frame);
+		seq.seed = hash(hash_combine(seed, data->time));
+	}
+
+	return seq;
+}
+
+/// Shuffled and scrambled Sobol points, padded with a different scramble per dimension pair
+float2 sample_2d(Sequence *seq) {
+	if (seq->type == SAMPLER_SOBOL) {
+		uint seed = hash_combine(seq->seed, hash(seq->dimension++));
+
+		uint index = nested_uniform_scramble(seq->index, seed);
+		uint2 p = sobol_2d(index);
+		p.x = nested_uniform_scramble(p.x, hash_combine(seed, 0));
+		p.y = nested_uniform_scramble(p.y, hash_combine(seed, 1));
+
+		// Keep 24 bits so the result stays below 1
+		return convert_float2(p >> 8) * 0x1p-24f;
+	}
+
+	float x = random_float(&seq->seed);
+	float y = random_float(&seq->seed);
+	return (float2)(x, y);
+}
+
+float sample_1d(Sequence *seq) {
+	if (seq->type == SAMPLER_SOBOL) {
+		return sample_2d(seq).x;
+	}
+
+	return random_float(&seq->seed);
+}
+
+/// Builds the tangent and bitangent of the unit vector `n`, see Duff et al. 2017,
+/// "Building an Orthonormal Basis, Revisited"
+inline void orthonormal_basis(float3 n, float3 *tangent, float3 *bitangent) {
+	float s = copysign(1.0f, n.z);
+	float a = -1.0f / (s + n.z);
+	float b = n.x * n.y * a;
+	*tangent = (float3)(1.0f + s * n.x * n.x * a, s * b, -s * n.x);
+	*bitangent = (float3)(b, s + n.y * n.y * a, -n.y);
+}
+
+/// Cosine weighted direction in the hemisphere of `normal`, from two uniform numbers
+inline float3 cosine_direction(float3 normal, float2 u) {
+	float3 tangent, bitangent;
+	orthonormal_basis(normal, &tangent, &bitangent);
+
+	// Uniform point on the disk, projected up to the hemisphere (Malley's method)
+	float r = sqrt(u.x);
+	float cos_phi;
+	float sin_phi = sincos(2.0f * M_PI_F * u.y, &cos_phi);
+
+	return tangent * (r * cos_phi) + bitangent * (r * sin_phi) + normal * sqrt(max(0.0f, 1.0f - u.x));
 }
 
 inline float length_squared(float3 v) {
@@ -170,21 +416,20 @@ inline float distance_squared(float3 a, float3 b) {
 	return length_squared(b - a);
 }
 
-inline float shlick_reflectance(float mu, float cos_theta) {
-	float r0 = (1.0 - mu) / (1.0 + mu);
-	r0 = r0 * r0;
-
-	return r0 + (1.0 - r0) * pown(1.0 - cos_theta, 5);
+/// @param r0 Reflectance at normal incidence, the same from either side of the surface
+inline float shlick_reflectance(float r0, float cos_theta) {
+	return r0 + (1.0f - r0) * pown(1.0f - cos_theta, 5);
 }
 
-bool intersect_sphere(__generic const Sphere *sphere, const Ray *ray, float *t) {
-	float3 rayToCenter = sphere->position - ray->origin;
+/// @param sphere Center (xyz) and radius (w)
+bool intersect_sphere(float4 sphere, const Ray *ray, float *t) {
+	float3 rayToCenter = sphere.xyz - ray->origin;
 
 	/* calculate coefficients a, b, c from quadratic equation */
 
 	/* float a = dot(ray->dir, ray->dir); // ray direction is normalised, dotproduct simplifies to 1 */
 	float b = dot(rayToCenter, ray->direction);
-	float c = dot(rayToCenter, rayToCenter) - sphere->radius * sphere->radius;
+	float c = dot(rayToCenter, rayToCenter) - sphere.w * sphere.w;
 	float disc = b * b - c; /* discriminant of quadratic formula */
 
 	/* solve for t (distance to hitpoint along ray) */
@@ -203,13 +448,14 @@ bool intersect_sphere(__generic const Sphere *sphere, const Ray *ray, float *t)
 	return true;
 }
 
-bool intersect_plane(__generic const Plane *plane, const Ray *ray, float *t) {
-	float denom = dot(plane->normal, ray->direction);
+/// @param plane Normal (xyz) and distance to the origin along the normal (w)
+bool intersect_plane(float4 plane, const Ray *ray, float *t) {
+	float denom = dot(plane.xyz, ray->direction);
 
 	if (fabs(denom) == 0.f)
 		return false;
 
-	float tmp = dot(plane->normal, plane->position - ray->origin) / denom;
+	float tmp = (plane.w - dot(plane.xyz, ray->origin)) / denom;
 
 	// Backwards intersection
 	if (tmp < 0.f)
@@ -221,9 +467,9 @@ bool intersect_plane(__generic const Plane *plane, const Ray *ray, float *t) {
 }
 
 float3 barycentric_weights(__generic Triangle *triangle, float3 p) {
-	float3 v0 = triangle->v1.pos - triangle->v0.pos;
-	float3 v1 = triangle->v2.pos - triangle->v0.pos;
-	float3 v2 = p - triangle->v0.pos;
+	float3 v0 = triangle->v1.pos.xyz - triangle->v0.pos.xyz;
+	float3 v1 = triangle->v2.pos.xyz - triangle->v0.pos.xyz;
+	float3 v2 = p - triangle->v0.pos.xyz;
 
     float d00 = dot(v0, v0);
     float d01 = dot(v0, v1);
@@ -244,8 +490,8 @@ float intersect_triangle(__generic Triangle *triangle, const Ray *ray, float *t)
 	float3 edge1, edge2, h, s, q;
 	float a, f, u, v;
 
-	edge1 = triangle->v1.pos - triangle->v0.pos;
-	edge2 = triangle->v2.pos - triangle->v0.pos;
+	edge1 = triangle->v1.pos.xyz - triangle->v0.pos.xyz;
+	edge2 = triangle->v2.pos.xyz - triangle->v0.pos.xyz;
 
 	h = cross(ray->direction, edge2);
 	a = dot(edge1, h);
@@ -254,7 +500,7 @@ float intersect_triangle(__generic Triangle *triangle, const Ray *ray, float *t)
 		return false;
 
 	f = 1.f / a;
-	s = ray->origin - triangle->v0.pos;
+	s = ray->origin - triangle->v0.pos.xyz;
 	u = f * dot(s, h);
 
 	if (u < 0.f || u > 1.f)
@@ -276,7 +522,10 @@ float intersect_triangle(__generic Triangle *triangle, const Ray *ray, float *t)
 
 /// @param inv_dir Reciprocal of every component of ray.dir
 /// @param tmax Avoid looking for bounding boxes that are too far
-bool intersection_aabb(float3 bounds_min, float3 bounds_max, const Ray *ray, float3 inv_dir, float tmax) {
+/// @param entry Distance at which the ray enters the box, 0 if it starts inside
+bool intersection_aabb_entry(
+	float3 bounds_min, float3 bounds_max, const Ray *ray, float3 inv_dir, float tmax, float *entry
+) {
 	float tmin = 0.0f;
 	for (int d = 0; d < 3; d++) {
 		float t1 = (bounds_min[d] - ray->origin[d]) * inv_dir[d];
@@ -286,90 +535,236 @@ bool intersection_aabb(float3 bounds_min, float3 bounds_max, const Ray *ray, flo
 		tmax = min(tmax, max(t1, t2));
 	}
 
+	*entry = tmin;
 	return tmin < tmax;
 }
 
-/// Returns the material index of the closest intersection
-int closest_intersection(const Scene *scene, const Ray *ray, Intersection *rayhit) {
-	int closest = -1;
+bool intersection_aabb(float3 bounds_min, float3 bounds_max, const Ray *ray, float3 inv_dir, float tmax) {
+	float entry;
+	return intersection_aabb_entry(bounds_min, bounds_max, ray, inv_dir, tmax, &entry);
+}
+
+/// Inverse of the octahedral mapping of the unit sphere to [-1, 1]^2
+float3 decode_octahedral(float2 e) {
+	float3 n = (float3)(e, 1.0f - fabs(e.x) - fabs(e.y));
+	float t = max(-n.z, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.y += n.y >= 0.0f ? -t : t;
+	return normalize(n);
+}
+
+inline float half_bits_to_float(ushort bits) {
+	return vload_half(0, (const half *)&bits);
+}
+
+/// Loads a triangle of the meshes, only its positions when they are compressed
+/// @param quantization Object space size of a quantization step of the model
+inline Triangle load_triangle(const Scene *scene, uint index, float3 local_min, float3 quantization) {
+#ifdef COMPRESSED_MESHES
+	PackedTriangle packed = scene->triangles[index];
+
+	Triangle triangle;
+	for (int j = 0; j < 3; j++) {
+		triangle.vertices[j].pos.xyz = local_min + convert_float3(packed.vertices[j].position.xyz) * quantization;
+	}
+	return triangle;
+#else
+	return scene->triangles[index];
+#endif
+}
+
+/// Decodes the normals and texture coordinates left out by `load_triangle`, only needed for hits
+inline void load_triangle_attributes(const Scene *scene, uint index, Triangle *triangle) {
+#ifdef COMPRESSED_MESHES
+	PackedTriangle packed = scene->triangles[index];
+
+	for (int j = 0; j < 3; j++) {
+		PackedVertex vertex = packed.vertices[j];
+		float2 octahedral = max(convert_float2(as_short2(vertex.normal.xy)) / 32767.0f, -1.0f);
+		triangle->vertices[j].normal.xyz = decode_octahedral(octahedral);
+		triangle->vertices[j].normal.w = half_bits_to_float(vertex.position.w);
+		triangle->vertices[j].pos.w = half_bits_to_float(vertex.normal.z);
+	}
+#endif
+}
+
+/// Tests a triangle of a model against the closest hit so far. On a closer hit, `tmin` is
+/// updated and `rayhit` gets the interpolated normal and texture coordinates.
+bool intersect_model_triangle(
+	const Scene *scene, __global const Model *model, uint index, float3 quantization, const Ray *ray,
+	float *tmin, Intersection *rayhit, Cost *cost
+) {
+	Triangle triangle = load_triangle(scene, index, model->local_min, quantization);
+	for (size_t j = 0; j <= 2; j++) {
+		triangle.vertices[j].pos.xyz = transform_mat(model->transform, triangle.vertices[j].pos.xyz, true);
+	}
+
+	float t_i;
+	COUNT_COST(cost->triangle_tests);
+	if (!intersect_triangle(&triangle, ray, &t_i) || t_i >= *tmin) {
+		return false;
+	}
+	*tmin = t_i;
+
+	if (rayhit != NULL) {
+		float3 position = ray->origin + ray->direction * t_i;
+		load_triangle_attributes(scene, index, &triangle);
+
+		// Smooth shading, u is interpolated with the normal
+		float3 weights = barycentric_weights(&triangle, position);
+		float4 normal_u = triangle.v0.normal*weights.x + triangle.v1.normal*weights.y + triangle.v2.normal*weights.z;
+		rayhit->normal = transform_mat(model->transform, normal_u.xyz, false);
+		rayhit->normal = normalize(rayhit->normal);
+
+		float3 v = (float3)(triangle.v0.pos.w, triangle.v1.pos.w, triangle.v2.pos.w);
+		rayhit->uv = (float2)(normal_u.w, dot(weights, v));
+
+		// Ratio of the areas of the triangle in texture and world space
+		float2 duv1 = (float2)(triangle.v1.normal.w - triangle.v0.normal.w, v.y - v.x);
+		float2 duv2 = (float2)(triangle.v2.normal.w - triangle.v0.normal.w, v.z - v.x);
+		float uv_area = fabs(duv1.x * duv2.y - duv1.y * duv2.x);
+		float world_area = length(cross(triangle.v1.pos.xyz - triangle.v0.pos.xyz, triangle.v2.pos.xyz - triangle.v0.pos.xyz));
+		rayhit->uv_density = sqrt(uv_area / max(world_area, 1e-12f));
+	}
+
+	return true;
+}
+
+/// Returned by `closest_intersection` when a page that isn't resident may hold a closer hit
+#define MISSING_GEOMETRY -2
+
+/// Returns the material index of the closest intersection, -1 if there is none
+int closest_intersection(const Scene *scene, const Ray *ray, Intersection *rayhit, Cost *cost) {
 	float tmin = INFINITY;
 
+	// Sphere and plane normals are only computed for the closest hit, models compute theirs
+	// when they are hit since they need the triangle
+	ShapeType closest_type = SHAPE_SPHERE;
+	int closest_index = -1;
+
 	float3 inv_dir = 1.0f / ray->direction;
 
-	for (int i = 0; i < scene->data->num_shapes; i++) {
-		__generic const Shape *shape = &scene->shapes[i];
-		if (shape->type == SHAPE_SPHERE) {
-			__generic const Sphere *sphere = &shape->shape.sphere;
+	// Each type is tested in its own loop, so neighbouring work items run the same code
+#ifndef NO_SPHERES
+	for (int i = 0; i < scene->data->num_spheres; i++) {
+		COUNT_COST(cost->sphere_tests);
 
-			float t_i;
-			if (intersect_sphere(sphere, ray, &t_i)) {
-				if (t_i < tmin) {
-					tmin = t_i;
-					closest = shape->material;
+		float t_i;
+		if (intersect_sphere(scene->spheres[i], ray, &t_i) && t_i < tmin) {
+			tmin = t_i;
+			closest_type = SHAPE_SPHERE;
+			closest_index = i;
+		}
+	}
+#endif
+#ifndef NO_PLANES
+	for (int i = 0; i < scene->data->num_planes; i++) {
+		COUNT_COST(cost->plane_tests);
+
+		float t_i;
+		if (intersect_plane(scene->planes[i], ray, &t_i) && t_i < tmin) {
+			tmin = t_i;
+			closest_type = SHAPE_PLANE;
+			closest_index = i;
+		}
+	}
+#endif
+#ifndef NO_MODELS
+#ifdef PAGED_GEOMETRY
+	// Closest entry into a page that isn't resident
+	float missing = INFINITY;
+#endif
+	for (int m = 0; m < scene->data->num_models; m++) {
+		__global const Model *model = &scene->models[m];
+		// Test bounding box first
+		COUNT_COST(cost->aabb_tests);
+		if (!intersection_aabb(model->bounding_min, model->bounding_max, ray, inv_dir, tmin)) {
+			continue;
+		}
 
-					if (rayhit != NULL) {
-						rayhit->position = ray->origin + ray->direction * tmin;
-						rayhit->normal = (rayhit->position - sphere->position) / sphere->radius;
-					}
-				}
-			}
-		} else if (shape->type == SHAPE_MODEL) {
-			__generic const Model *model = &shape->shape.model;
-			// Test bounding box first
-			if (!intersection_aabb(model->bounding_min, model->bounding_max, ray, inv_dir, tmin)) {
+		// Object space size of a quantization step, when the meshes are compressed
+		float3 quantization = (model->local_max - model->local_min) / 65535.0f;
+
+#ifdef PAGED_GEOMETRY
+		// Only the pages crossed by the ray are tested, they may not even be resident
+		for (uint p = 0; p < model->num_pages; p++) {
+			PageBounds page = scene->page_bounds[model->first_page + p];
+			COUNT_COST(cost->aabb_tests);
+			float entry;
+			if (!intersection_aabb_entry(page.bounds_min.xyz, page.bounds_max.xyz, ray, inv_dir, tmin, &entry)) {
 				continue;
 			}
 
-			// Test every triangle in the model
-			for (size_t i = 0; i < model->num_triangles; i++) {
-				Triangle triangle = scene->triangles[model->triangle_index + i];
-				for (size_t j = 0; j <= 2; j++) {
-					triangle.vertices[j].pos = transform_mat(model->transform, triangle.vertices[j].pos, true);
-				}
-
-				float t_i;
-				if (intersect_triangle(&triangle, ray, &t_i)) {
-					if (t_i < tmin) {
-						tmin = t_i;
-						closest = shape->material;
-
-						if (rayhit != NULL) {
-							rayhit->position = ray->origin + ray->direction * tmin;
-
-							// Smooth shading
-							float3 weights = barycentric_weights(&triangle, rayhit->position);
-							rayhit->normal = triangle.v0.normal*weights.x + triangle.v1.normal*weights.y + triangle.v2.normal*weights.z;
-							rayhit->normal = transform_mat(model->transform, rayhit->normal, false);
-							rayhit->normal = normalize(rayhit->normal);
+			// Missing pages are streamed in for the next frames
+			uint page_index = as_uint(page.bounds_min.w);
+			scene->geometry_feedback[page_index] = 1;
+			uint slot = scene->geometry_page_table[page_index];
+			if (slot == PAGE_NOT_RESIDENT) {
+				missing = min(missing, entry);
+				continue;
+			}
 
-							// Assume couter-clockwise vertex order (-Z main axis)
-							float3 computed_normal = cross(triangle.v1.pos - triangle.v0.pos, triangle.v2.pos - triangle.v0.pos);
-						}
-					}
+			uint first = slot * GEOMETRY_PAGE_TRIANGLES;
+			uint end = first + as_uint(page.bounds_max.w);
+			for (uint index = first; index < end; index++) {
+				if (intersect_model_triangle(scene, model, index, quantization, ray, &tmin, rayhit, cost)) {
+					closest_type = SHAPE_MODEL;
+					closest_index = m;
 				}
 			}
-		} else if (shape->type == SHAPE_PLANE) {
-			__generic const Plane *plane = &shape->shape.plane;
-
-			float t_i;
-			if (intersect_plane(plane, ray, &t_i)) {
-				if (t_i < tmin) {
-					tmin = t_i;
-					closest = shape->material;
-
-					if (rayhit != NULL) {
-						rayhit->normal = plane->normal;
-						rayhit->position = ray->origin + ray->direction * tmin;
-					}
-				}
+		}
+#else
+		// Test every triangle in the model
+		for (uint i = 0; i < model->num_triangles; i++) {
+			uint index = model->triangle_index + i;
+			if (intersect_model_triangle(scene, model, index, quantization, ray, &tmin, rayhit, cost)) {
+				closest_type = SHAPE_MODEL;
+				closest_index = m;
 			}
 		}
+#endif
 	}
+#ifdef PAGED_GEOMETRY
+	// Whatever was hit, the ray may have stopped earlier in the missing page
+	if (missing < tmin)
+		return MISSING_GEOMETRY;
+#endif
+#endif
 
-	if (tmin == FLT_MAX)
+	if (closest_index < 0)
 		return -1;
 
+	// Materials are stored by type in the same order as the loops
+	int material_offset = 0;
+	if (closest_type != SHAPE_SPHERE)
+		material_offset += scene->data->num_spheres;
+	if (closest_type == SHAPE_MODEL)
+		material_offset += scene->data->num_planes;
+	int closest = scene->shape_materials[material_offset + closest_index];
+
 	if (rayhit != NULL) {
+		rayhit->position = ray->origin + ray->direction * tmin;
+
+		if (closest_type == SHAPE_SPHERE) {
+			float4 sphere = scene->spheres[closest_index];
+			rayhit->normal = (rayhit->position - sphere.xyz) / sphere.w;
+
+			// Longitude and latitude, u goes around the circumference
+			rayhit->uv = (float2)(
+				atan2pi(rayhit->normal.z, rayhit->normal.x) * 0.5f + 0.5f,
+				asinpi(clamp(rayhit->normal.y, -1.0f, 1.0f)) + 0.5f
+			);
+			rayhit->uv_density = 1.0f / (2.0f * M_PI_F * sphere.w);
+		} else if (closest_type == SHAPE_PLANE) {
+			rayhit->normal = scene->planes[closest_index].xyz;
+
+			// One texture repeat per world unit
+			float3 tangent, bitangent;
+			orthonormal_basis(rayhit->normal, &tangent, &bitangent);
+			rayhit->uv = (float2)(dot(rayhit->position, tangent), dot(rayhit->position, bitangent));
+			rayhit->uv_density = 1.0f;
+		}
+
 		rayhit->front = dot(rayhit->normal, ray->direction) < 0.0f;
 		rayhit->normal *= rayhit->front ? 1.0f : -1.0f; // Reflect normal to always face the camera
 	}
@@ -377,6 +772,101 @@ int closest_intersection(const Scene *scene, const Ray *ray, Intersection *rayhi
 	return closest;
 }
 
+inline int tiles_along(int texels) {
+	return (texels + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+}
+
+/// Texel of a mip level, false if its tile isn't resident
+/// @param camera Wether the texture is sampled at the hit of a camera ray
+inline bool fetch_texel(const Scene *scene, uint level_tile, int width, int x, int y, bool camera, float4 *texel) {
+	uint tile = level_tile + (y / TEXTURE_TILE_SIZE) * tiles_along(width) + x / TEXTURE_TILE_SIZE;
+	uint slot = scene->page_table[tile];
+	if (slot == TILE_NOT_RESIDENT) {
+		// The canvas is restarted once the tiles missed by camera rays are resident
+		scene->feedback[2 * tile] = 1;
+		if (camera) {
+			scene->feedback[2 * tile + 1] = 1;
+		}
+		return false;
+	}
+
+	uint inside = (y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE;
+	*texel = convert_float4(scene->tile_pool[slot * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE + inside]);
+	return true;
+}
+
+/// Bilinear sample of one mip level, repeating outside of [0, 1]. False if one of the texels
+/// isn't resident.
+bool sample_level(const Scene *scene, uint level_tile, int width, int height, float2 uv, bool camera, float4 *result) {
+	float2 p = (uv - floor(uv)) * (float2)(width, height) - 0.5f;
+	float2 base = floor(p);
+	float2 f = p - base;
+
+	int x0 = ((int)base.x + width) % width;
+	int y0 = ((int)base.y + height) % height;
+	int x1 = (x0 + 1) % width;
+	int y1 = (y0 + 1) % height;
+
+	// Marks the tile as used even if it is resident, so it isn't evicted
+	scene->feedback[2 * (level_tile + (y0 / TEXTURE_TILE_SIZE) * tiles_along(width) + x0 / TEXTURE_TILE_SIZE)] = 1;
+
+	float4 a, b, c, d;
+	bool resident = fetch_texel(scene, level_tile, width, x0, y0, camera, &a);
+	resident &= fetch_texel(scene, level_tile, width, x1, y0, camera, &b);
+	resident &= fetch_texel(scene, level_tile, width, x0, y1, camera, &c);
+	resident &= fetch_texel(scene, level_tile, width, x1, y1, camera, &d);
+	if (!resident)
+		return false;
+
+	*result = mix(mix(a, b, f.x), mix(c, d, f.x), f.y) / 255.0f;
+	return true;
+}
+
+/// Trilinear sample of a texture. Missing tiles are requested and replaced by the closest
+/// coarser level that is resident, the levels that fit in a single tile always are.
+/// @param footprint Width covered by the ray around the hit, in texture coordinates
+/// @param camera Wether the hit is the one of a camera ray
+float4 sample_texture(const Scene *scene, int index, float2 uv, float footprint, bool camera) {
+	Texture texture = scene->textures[index];
+
+	float lod = log2(max(footprint * max(texture.width, texture.height), 1.0f));
+	lod = min(lod, (float)(texture.num_levels - 1));
+	int level = (int)lod;
+
+	uint level_tile = texture.first_tile;
+	int width = texture.width, height = texture.height;
+	for (int i = 0; i < level; i++) {
+		level_tile += tiles_along(width) * tiles_along(height);
+		width = max(width / 2, 1);
+		height = max(height / 2, 1);
+	}
+
+	float4 texel;
+	bool exact = sample_level(scene, level_tile, width, height, uv, camera, &texel);
+	if (!exact) {
+		do {
+			level_tile += tiles_along(width) * tiles_along(height);
+			width = max(width / 2, 1);
+			height = max(height / 2, 1);
+		} while (!sample_level(scene, level_tile, width, height, uv, camera, &texel));
+	}
+
+	if (exact && level + 1 < texture.num_levels) {
+		uint next_tile = level_tile + tiles_along(width) * tiles_along(height);
+		float4 coarse;
+		if (sample_level(scene, next_tile, max(width / 2, 1), max(height / 2, 1), uv, camera, &coarse)) {
+			texel = mix(texel, coarse, lod - level);
+		}
+	}
+
+	return texel;
+}
+
+/// Color textures are stored in sRGB
+inline float3 srgb_to_linear(float3 c) {
+	return pow(c, 2.2f);
+}
+
 float3 sky_box(Ray ray, const Scene *scene, image2d_t skybox, sampler_t sampler) {
 	// float sky_gradient_t = pow(smoothstep(0.0f, 0.4f, ray.direction.y), 0.35f);
 	// float3 sky_gradient = mix(scene->data->horizon_color, scene->data->zenith_color, sky_gradient_t);
@@ -393,58 +883,99 @@ float3 sky_box(Ray ray, const Scene *scene, image2d_t skybox, sampler_t sampler)
 	return read_imagef(skybox, sampler, (float2)(u, v)).xyz + sun;
 }
 
-float3 trace(const RenderData *render, const Scene *scene, Ray *camray, uint seed, image2d_t skybox, sampler_t sampler) {
+float3 trace(const RenderData *render, const Scene *scene, Ray *camray, Sequence *seq, image2d_t skybox, sampler_t sampler, FirstHit *first_hit, Cost *cost) {
 	float3 color = (float3)(0.f);
 	float3 mask = (float3)(1.f);
 
 	Ray ray = *camray;
 	Intersection rayhit;
 
-	for (int i = 0; i < render->num_bounces; i++) {
-		int material_index = closest_intersection(scene, &ray, &rayhit);
+	first_hit->depth = INFINITY;
+	first_hit->normal = -camray->direction;
+	first_hit->albedo = (float3)(1.0f);
+	first_hit->missing_geometry = false;
+
+	// Ray cone of the pixel, its width at a hit selects the mip level of the textures
+	float spread = 2.0f * render->fov_scale * max(render->downscale, 1) / render->height;
+	float travelled = 0.0f;
+
+	COUNT_COST(cost->paths);
+	for (int i = 0; i < NUM_BOUNCES_OF(render); i++) {
+		COUNT_COST(cost->rays);
+		int material_index = closest_intersection(scene, &ray, &rayhit, cost);
+
+#ifdef PAGED_GEOMETRY
+		if (material_index == MISSING_GEOMETRY) {
+			first_hit->missing_geometry = true;
+			break;
+		}
+#endif
 
 		if (material_index >= 0) {
-			if (render->show_normals) {
+			// One copy to registers, instead of a load at every use
+			Material material = scene->materials[material_index];
+
+			travelled += distance(ray.origin, rayhit.position);
+#ifndef NO_TEXTURES
+			float footprint = spread * travelled * rayhit.uv_density;
+			bool camera = i == 0;
+			if (material.textures.x >= 0) {
+				material.color.xyz *= srgb_to_linear(sample_texture(scene, material.textures.x, rayhit.uv, footprint, camera).xyz);
+			}
+			if (material.textures.y >= 0) {
+				material.color.w = 1.0f - sample_texture(scene, material.textures.y, rayhit.uv, footprint, camera).x;
+			}
+			if (material.textures.z >= 0) {
+				material.emission.xyz *= srgb_to_linear(sample_texture(scene, material.textures.z, rayhit.uv, footprint, camera).xyz);
+			}
+#endif
+
+			if (i == 0) {
+				first_hit->depth = distance(camray->origin, rayhit.position);
+				first_hit->normal = rayhit.normal;
+				first_hit->albedo = material.color.xyz;
+			}
+
+			if (SHOW_NORMALS_OF(render)) {
 				color = rayhit.normal*0.5f + 0.5f;
 				break;
 			}
 
-			__generic const Material *material = &scene->materials[material_index];
-			color += mask * material->emission * material->emission_strength;
+			color += mask * material.emission.xyz;
 
-			if (i == render->num_bounces - 1)
+			if (i == NUM_BOUNCES_OF(render) - 1)
 				break; // Don't compute new bounce if it's the last one
 
 			ray.origin = rayhit.position;
 
-			// cosine weighted distribution
-			float3 random_dir = normalize(rayhit.normal + random_direction_hemisphere(rayhit.normal, &seed));
+			// cosine weighted distribution, shared by the diffuse, metallic and transmissive paths
+			float3 random_dir = cosine_direction(rayhit.normal, sample_2d(seq));
 			float3 reflected_dir = reflect(ray.direction, rayhit.normal);
 
-			bool is_metallic = material->metallic > random_float(&seed);
-			bool is_specular = material->specular > random_float(&seed);
+			bool is_metallic = material.lobes.x > sample_1d(seq);
+			bool is_specular = material.lobes.y > sample_1d(seq);
 
-			float3 rough_dir = mix(random_dir, reflected_dir, material->smoothness);
+			float3 rough_dir = mix(random_dir, reflected_dir, material.color.w);
 
-			bool is_transparent = material->transmittance > random_float(&seed);
+			bool is_transparent = material.lobes.z > sample_1d(seq);
 
 			if (!is_transparent) {
 				ray.direction = mix(random_dir, rough_dir, is_metallic || is_specular);
 
 				// diffuse reflection and metal reflection = color with object's albedo
 				// specular refection = white reflection
-				mask *= mix(material->color, (float3)(1.0f), is_specular);
+				mask *= mix(material.color.xyz, (float3)(1.0f), is_specular);
 			} else {
 				// roughness affects refraction
 				// this gives `ray.direction` for a perfectly smooth surface
 				float3 in_dir = reflect(rough_dir, rayhit.normal);
 
-				float mu = rayhit.front ? 1.0f / material->refraction_index : material->refraction_index;
+				float mu = rayhit.front ? 1.0f / material.lobes.w : material.lobes.w;
 				float cos_theta = min(1.0f, dot(in_dir, -rayhit.normal));
 				float sin_theta = sqrt(1.0f - cos_theta * cos_theta);
 
 				bool transparency_reflected = mu * sin_theta > 1.0f // total internal reflection
-					|| shlick_reflectance(mu, cos_theta) > random_float(&seed);
+					|| shlick_reflectance(material.emission.w, cos_theta) > sample_1d(seq);
 
 				if (transparency_reflected) {
 					ray.direction = rough_dir;
@@ -454,13 +985,14 @@ float3 trace(const RenderData *render, const Scene *scene, Ray *camray, uint see
 					float3 refracted_dir = out_perp + out_parallel;
 
 					ray.direction = refracted_dir;
-					mask *= material->color;
+					mask *= material.color.xyz;
 				}
 			} 
 
 			ray.direction = normalize(ray.direction);
 			ray.origin += rayhit.normal * sign(dot(rayhit.normal, ray.direction)) * 0.001f; // avoid shadow acne
 		} else { // No collision -- Sky
+			COUNT_COST(cost->sky_escapes);
 			mask *= sky_box(ray, scene, skybox, sampler);
 			color += mask;
 			break;
@@ -480,56 +1012,272 @@ float3 aces(float3 x) {
 	return clamp((x * (x * a + b)) / (x * (x * c + d) + e), (float3)(0.0f), (float3)(1.0f));
 }
 
+/// Offset of the sample counts of a half canvas in uints, after the means rounded up to a uint
+inline uint half_canvas_counts(const RenderData *data) {
+	return ((uint)data->width * data->height * 3 + 1) / 2;
+}
+
+/// Canvas pixels store the running mean of the samples in xyz and the number of samples in w.
+/// Half canvases store the means as half3, followed by the counts as uint since a half can't
+/// count past 2048.
+float4 load_canvas(const RenderData *data, __global const float *canvas, uint id) {
+	if (data->half_canvas) {
+		float3 mean = vload_half3(id, (__global const half *)canvas);
+		uint count = ((__global const uint *)canvas)[half_canvas_counts(data) + id];
+		return (float4)(mean, count);
+	}
+	return vload4(id, canvas);
+}
+
+void store_canvas(const RenderData *data, __global float *canvas, uint id, float4 value) {
+	if (data->half_canvas) {
+		vstore_half3(value.xyz, id, (__global half *)canvas);
+		((__global uint *)canvas)[half_canvas_counts(data) + id] = (uint)value.w;
+	} else {
+		vstore4(value, id, canvas);
+	}
+}
+
+uchar4 tonemap(float3 color) {
+	color = aces(color);
+	color = sqrt(color);
+
+	// ARGB
+	return (uchar4)(255, color.x * 255.0f, color.y * 255.0f, color.z * 255.0f);
+}
+
+/// Samples over which a half canvas stops averaging and keeps an exponential moving average.
+/// Past a few thousand samples, a 1/n step is smaller than the rounding of a half and the mean
+/// would stop moving.
+#define HALF_CANVAS_MAX_SAMPLES 256.0f
+
+/// Adds `color` to the running mean of the pixel
+void accumulate(const RenderData *data, __global float *canvas, __global uchar4 *output, uint id, float3 color) {
+	float4 accumulated = load_canvas(data, canvas, id);
+	float num_steps = accumulated.w + 1.0f;
+	float weight = data->half_canvas ? max(1.0f / num_steps, 1.0f / HALF_CANVAS_MAX_SAMPLES) : 1.0f / num_steps;
+	accumulated.xyz = mix(accumulated.xyz, color, weight);
+	accumulated.w = num_steps;
+	store_canvas(data, canvas, id, accumulated);
+
+	if (data->fuse_tonemap) {
+		output[id] = tonemap(accumulated.xyz);
+	}
+}
+
+/// Adds the counters of the whole work group to the 64 bit totals of `stats`, stored as
+/// (low, high) pairs of uints since 64 bit atomics are an extension
+void add_ray_stats(__global uint *stats, const Cost *cost) {
+	uint counters[NUM_RAY_STATS] = {
+		cost->paths, cost->rays, cost->sky_escapes, cost->sphere_tests, cost->plane_tests,
+		cost->aabb_tests, cost->triangle_tests
+	};
+
+	bool leader = get_local_id(0) == 0 && get_local_id(1) == 0;
+	for (int i = 0; i < NUM_RAY_STATS; i++) {
+		ulong sum = work_group_reduce_add((ulong)counters[i]);
+		if (!leader || sum == 0)
+			continue;
+
+		uint low = (uint)sum;
+		uint high = (uint)(sum >> 32);
+		uint previous = atomic_add(&stats[2 * i], low);
+		if (previous + low < previous) {
+			high++; // carry
+		}
+		if (high != 0) {
+			atomic_add(&stats[2 * i + 1], high);
+		}
+	}
+}
+
 __kernel void render(
-	const RenderData data, const SceneData sceneData, __global float3 *output, __global const Shape *shapes,
-	__global const Triangle *triangles, __global const Material *materials,
-	image2d_t skybox, sampler_t sampler
+	const RenderData data, const SceneData sceneData, __global float *canvas, __global const float4 *spheres,
+	__global const float4 *planes, __global const Model *models, __global const int *shape_materials,
+	__global const MeshTriangle *triangles, MATERIAL_SPACE const Material *materials,
+	__global const Texture *textures, __global const uint *page_table, __global const uchar4 *tile_pool,
+	__global uchar *feedback, __global const PageBounds *page_bounds, __global const uint *geometry_page_table,
+	__global uchar *geometry_feedback,
+	image2d_t skybox, sampler_t sampler, __global uchar4 *output, __global float *depth,
+	__global float4 *albedo, __global float4 *normals, __global uint4 *cost, __global uint *stats
 ) {
-	uint id = get_global_id(0) + get_global_id(1)*data.width;
-	Scene scene = {.data = &sceneData, .shapes = shapes, .triangles = triangles, .materials = materials};
-	float2 windowPos = (float2)(get_global_id(0), get_global_id(1)); // Raster space coordinates
-
-	// output[id] += read_imagef()
+	int scale = max(data.downscale, 1);
+	uint x = get_global_id(0) * scale;
+	uint y = get_global_id(1) * scale;
+	// Every work item has to reach the statistics reduction, even outside of the image
+	Cost pixel_cost = {0, 0, 0, 0, 0, 0, 0};
+	if (x < data.width && y < data.height) {
+		uint id = x + y*data.width;
+		Scene scene = {
+			.data = &sceneData, .spheres = spheres, .planes = planes, .models = models,
+			.shape_materials = shape_materials, .triangles = triangles, .materials = materials,
+			.textures = textures, .page_table = page_table, .tile_pool = tile_pool, .feedback = feedback,
+			.page_bounds = page_bounds, .geometry_page_table = geometry_page_table,
+			.geometry_feedback = geometry_feedback
+		};
+		float2 windowPos = (float2)(x, y); // Raster space coordinates
+
+		float3 color = (float3)(0.f);
+		int num_traced = 0;
+		FirstHit pixel_hit;
+		for (int sample = 0; sample < data.num_samples; sample++) {
+			Sequence seq = sequence_init(&data, id, sample);
+
+			// Jitter over the whole block when downscaled
+			float2 jitter = sample_2d(&seq) * scale;
+			float2 ndcPos = (float2
+			)((windowPos.x + jitter.x) / data.width,
+			  (windowPos.y + jitter.y) / data.height); // Normalized coordinates
+			float2 screenPos = (float2
+			)((2.f * ndcPos.x - 1.f) * data.aspect_ratio * data.fov_scale,
+			  (1.f - 2.f * ndcPos.y) * data.fov_scale); // Screen space coordinates (invert y axis)
+			float3 cameraPos = (float3)(screenPos, -1.0f);
+
+			Ray ray;
+			// 1 0 0 x
+			// 0 1 0 y
+			// 0 0 1 z
+			// 0 0 0 1
+			// Get translation part
+			ray.origin = data.camera_to_world[3].xyz;
+
+			// vec4 with 0 at the end is only affected by rotation, not translation
+			// Only normalize 3d components
+			ray.direction = normalize(matrix_by_vector(data.camera_to_world, (float4)(cameraPos.xyz, 0)).xyz);
+
+			FirstHit sample_hit;
+			float3 sample_color = trace(&data, &scene, &ray, &seq, skybox, sampler, &sample_hit, &pixel_cost);
+
+			// It would show a hole where the geometry is being streamed in
+			if (sample_hit.missing_geometry)
+				continue;
 
-	float3 color = (float3)(0.f);
-	for (int sample = 0; sample < data.num_samples; sample++) {
-		uint seed = (sample + id * data.num_samples) * data.time * 5304;
-
-		float2 ndcPos = (float2
-		)((windowPos.x + random_float(&seed)) / data.width,
-		  (windowPos.y + random_float(&seed)) / data.height); // Normalized coordinates
-		float2 screenPos = (float2
-		)((2.f * ndcPos.x - 1.f) * data.aspect_ratio * data.fov_scale,
-		  (1.f - 2.f * ndcPos.y) * data.fov_scale); // Screen space coordinates (invert y axis)
-		float3 cameraPos = (float3)(screenPos, -1.0f);
-
-		Ray ray;
-		// 1 0 0 x
-		// 0 1 0 y
-		// 0 0 1 z
-		// 0 0 0 1
-		// Get translation part
-		ray.origin = data.camera_to_world[3].xyz;
-
-		// vec4 with 0 at the end is only affected by rotation, not translation
-		// Only normalize 3d components
-		ray.direction = normalize(matrix_by_vector(data.camera_to_world, (float4)(cameraPos.xyz, 0)).xyz);
-
-		color += trace(&data, &scene, &ray, seed, skybox, sampler);
+			color += sample_color;
+			if (num_traced++ == 0) {
+				pixel_hit = sample_hit;
+			}
+		}
+		color /= max(num_traced, 1);
+
+		// Nearest neighbour upscale of the block
+		uint end_x = min(x + scale, (uint)data.width);
+		uint end_y = min(y + scale, (uint)data.height);
+		for (uint py = y; py < end_y; py++) {
+			for (uint px = x; px < end_x; px++) {
+				uint pixel = px + py*data.width;
+				// Every sample was dropped, the pixel keeps the ones it has
+				if (num_traced > 0) {
+					accumulate(&data, canvas, output, pixel, color);
+					depth[pixel] = pixel_hit.depth;
+
+					if (data.write_aovs) {
+						albedo[pixel] = (float4)(pixel_hit.albedo, 0.0f);
+						normals[pixel] = (float4)(pixel_hit.normal, 0.0f);
+					}
+				}
+#ifdef COST_HEATMAP
+				uint shape_tests = pixel_cost.sphere_tests + pixel_cost.plane_tests + pixel_cost.aabb_tests;
+				cost[pixel] = (uint4)(shape_tests, pixel_cost.aabb_tests, pixel_cost.triangle_tests, pixel_cost.rays);
+#endif
+			}
+		}
 	}
-	color /= data.num_samples;
 
-	output[id] += color;
+#ifdef RAY_STATS
+	add_ray_stats(stats, &pixel_cost);
+#endif
 }
 
-__kernel void average(const uint num_steps, __global const float3 *canvas, __global uchar4 *output) {
+__kernel void average(const RenderData data, __global const float *canvas, __global uchar4 *output) {
 	const uint id = get_global_id(0);
 
-	float3 color = canvas[id] / num_steps;
+	output[id] = tonemap(load_canvas(&data, canvas, id).xyz);
+}
 
-	color = aces(color);
-	color = sqrt(color);
+/// False color of one of the cost counters (x, y, z or w depending on `metric`), from blue
+/// for 0 to red for `scale` and above
+__kernel void heatmap(
+	const RenderData data, __global const uint4 *cost, int metric, float scale, __global uchar4 *output
+) {
+	const uint id = get_global_id(0);
+
+	uint4 counters = cost[id];
+	uint value = metric == 0 ? counters.x : metric == 1 ? counters.y : metric == 2 ? counters.z : counters.w;
+	float t = clamp(value / max(scale, 1.0f), 0.0f, 1.0f);
+
+	// Jet colormap
+	float3 color = clamp(
+		(float3)(1.5f) - fabs(4.0f * t - (float3)(3.0f, 2.0f, 1.0f)), (float3)(0.0f), (float3)(1.0f)
+	);
 
 	// ARGB
 	output[id] = (uchar4)(255, color.x * 255.0f, color.y * 255.0f, color.z * 255.0f);
 }
+
+/// Merges the canvas of the previous camera position into the freshly rendered canvas.
+/// Each pixel is moved back to world space using its depth, projected with the previous camera,
+/// and the history sample there is kept only if its depth agrees (no disocclusion).
+__kernel void reproject(
+	const RenderData data, const ReprojectionData previous, __global float *canvas,
+	__global const float *depth, __global const float *history, __global const float *history_depth,
+	__global uchar4 *output
+) {
+	uint x = get_global_id(0);
+	uint y = get_global_id(1);
+	uint id = x + y*data.width;
+
+	float4 current = load_canvas(&data, canvas, id);
+
+	// Ray through the center of the pixel
+	float2 ndcPos = (float2)((x + 0.5f) / data.width, (y + 0.5f) / data.height);
+	float2 screenPos = (float2
+	)((2.f * ndcPos.x - 1.f) * data.aspect_ratio * data.fov_scale,
+	  (1.f - 2.f * ndcPos.y) * data.fov_scale);
+	float3 direction = normalize(matrix_by_vector(data.camera_to_world, (float4)(screenPos, -1.0f, 0)).xyz);
+
+	// The sky is infinitely far away, so only its direction matters
+	float pixel_depth = depth[id];
+	bool sky = isinf(pixel_depth);
+	float4 world = sky ? (float4)(direction, 0.0f)
+	                   : (float4)(data.camera_to_world[3].xyz + direction * pixel_depth, 1.0f);
+
+	float3 previous_pos = matrix_by_vector(previous.world_to_camera, world).xyz;
+	if (previous_pos.z >= 0.0f)
+		return; // behind the previous camera
+
+	float2 previous_screen = previous_pos.xy / -previous_pos.z;
+	float2 previous_ndc = (float2
+	)(previous_screen.x / (previous.aspect_ratio * previous.fov_scale) * 0.5f + 0.5f,
+	  0.5f - previous_screen.y / previous.fov_scale * 0.5f);
+	int2 previous_pixel = convert_int2_rtn(previous_ndc * (float2)(data.width, data.height));
+
+	if (previous_pixel.x < 0 || previous_pixel.y < 0 || previous_pixel.x >= data.width || previous_pixel.y >= data.height)
+		return;
+
+	uint previous_id = previous_pixel.x + previous_pixel.y*data.width;
+
+	// Disocclusion test
+	float previous_depth = history_depth[previous_id];
+	if (sky) {
+		if (!isinf(previous_depth))
+			return;
+	} else {
+		float expected_depth = length(previous_pos);
+		if (!(fabs(previous_depth - expected_depth) <= previous.depth_tolerance * expected_depth))
+			return;
+	}
+
+	float4 old = load_canvas(&data, history, previous_id);
+	float old_steps = min(old.w, previous.max_history);
+	float num_steps = current.w + old_steps;
+	if (num_steps <= 0.0f)
+		return;
+
+	current.xyz = (current.xyz * current.w + old.xyz * old_steps) / num_steps;
+	current.w = num_steps;
+	store_canvas(&data, canvas, id, current);
+
+	if (data.fuse_tonemap) {
+		output[id] = tonemap(current.xyz);
+	}
+}
@@ -0,0 +1,234 @@
+#include <iostream>
+#include <random>
+
+#include "parser.hpp"
+#include "scenes.hpp"
+
+void SceneDescription::apply_camera(Tracer::RenderData &options) const {
+	options.aspect_ratio = static_cast<float>(options.width) / options.height;
+	options.fov_scale = glm::tan(fov / 2.f);
+	options.camera_to_world = camera.camera_matrix();
+}
+
+namespace scenes {
+
+void default_sky(Tracer::SceneData &scene_data) {
+	scene_data.horizon_color = color::from_hex(0x374F62);
+	scene_data.zenith_color = color::from_hex(0x11334A);
+	scene_data.ground_color = color::from_hex(0x777777);
+	scene_data.sun_focus = 25.0f;
+	scene_data.sun_color = color::from_hex(0xffffd3);
+	scene_data.sun_intensity = 1.0f;
+	scene_data.sun_direction = VEC3TOCL(glm::normalize(glm::vec3(1.0, -1.0, 0.0)));
+}
+
+SceneDescription spheres() {
+	SceneDescription scene;
+
+	scene.materials = {
+		Material(color::from_hex(0x777777)),
+		Material(color::from_hex(0xd04040)),
+		Material(color::from_hex(0xe0c080), 0.9f, 1.0f),
+		Material(color::white, 1.0f, 0.0f, 0.0f, 1.0f, 1.5f),
+		Material(color::white, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, color::from_hex(0xffe0b0), 4.0f),
+	};
+
+	scene.shapes = {
+		{0, Plane(glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f))},
+		{1, Sphere(glm::vec3(-2.5f, 0.0f, 0.0f), 1.0f)},
+		{2, Sphere(glm::vec3(0.0f, 0.0f, 0.0f), 1.0f)},
+		{3, Sphere(glm::vec3(2.5f, 0.0f, 0.0f), 1.0f)},
+		{4, Sphere(glm::vec3(0.0f, 3.0f, -3.0f), 0.75f)},
+	};
+
+	scene.camera = {{0.0f, 1.0f, 6.0f}, 0.0f, -0.15f};
+
+	return scene;
+}
+
+SceneDescription many_spheres(int count) {
+	SceneDescription scene;
+
+	scene.materials.push_back(Material(color::from_hex(0x777777)));
+	scene.shapes.push_back({0, Plane(glm::vec3(0.0f, -0.5f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f))});
+
+	// Fixed seed, so every run renders the same scene
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	for (int z = 0; z < count; z++) {
+		for (int x = 0; x < count; x++) {
+			Color color(uniform(rng), uniform(rng), uniform(rng));
+			float kind = uniform(rng);
+			if (kind < 0.6f) {
+				scene.materials.push_back(Material(color));
+			} else if (kind < 0.85f) {
+				scene.materials.push_back(Material(color, 0.8f + 0.2f * uniform(rng), 1.0f));
+			} else if (kind < 0.95f) {
+				scene.materials.push_back(Material(color::white, 1.0f, 0.0f, 0.0f, 1.0f, 1.5f));
+			} else {
+				scene.materials.push_back(
+					Material(color::white, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, color, 3.0f)
+				);
+			}
+
+			glm::vec3 position(x - count * 0.5f + 0.5f, 0.0f, -z);
+			position += glm::vec3(uniform(rng) - 0.5f, 0.0f, uniform(rng) - 0.5f) * 0.5f;
+			scene.shapes.push_back({(cl_int)scene.materials.size() - 1, Sphere(position, 0.35f)});
+		}
+	}
+
+	scene.camera = {{0.0f, 4.0f, 6.0f}, 0.0f, -0.45f};
+
+	return scene;
+}
+
+SceneDescription cornell_box() {
+	SceneDescription scene;
+	Box::create_triangle(scene.triangles);
+
+	scene.materials = {
+		Material(color::from_hex(0xbbbbbb)),
+		Material(color::from_hex(0xbb2222)),
+		Material(color::from_hex(0x22bb22)),
+		Material(color::white, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, color::from_hex(0xfff0d0), 8.0f),
+	};
+
+	// Walls are thin boxes around the [-1, 1] cube, the front is left open
+	const float t = 0.05f;
+	scene.shapes = {
+		{0, Box::model(glm::vec3(0.0f, -1.0f - t, 0.0f), glm::vec3(2.0f + 4 * t, 2 * t, 2.0f))},
+		{0, Box::model(glm::vec3(0.0f, 1.0f + t, 0.0f), glm::vec3(2.0f + 4 * t, 2 * t, 2.0f))},
+		{0, Box::model(glm::vec3(0.0f, 0.0f, -1.0f - t), glm::vec3(2.0f + 4 * t, 2.0f, 2 * t))},
+		{1, Box::model(glm::vec3(-1.0f - t, 0.0f, 0.0f), glm::vec3(2 * t, 2.0f, 2.0f))},
+		{2, Box::model(glm::vec3(1.0f + t, 0.0f, 0.0f), glm::vec3(2 * t, 2.0f, 2.0f))},
+		{3, Box::model(glm::vec3(0.0f, 1.0f - t * 0.5f, 0.0f), glm::vec3(0.6f, t, 0.6f))},
+		{0, Box::model(glm::vec3(-0.35f, -0.4f, -0.3f), glm::vec3(0.55f, 1.2f, 0.55f))},
+		{0, Box::model(glm::vec3(0.35f, -0.7f, 0.3f), glm::vec3(0.55f, 0.6f, 0.55f))},
+	};
+
+	scene.camera = {{0.0f, 0.0f, 3.8f}, 0.0f, 0.0f};
+	scene.fov = glm::radians(40.0f);
+
+	return scene;
+}
+
+/// Smooth shaded torus around the y axis
+static void create_torus(std::vector<Triangle> &triangles, int rings, int sides) {
+	const float major = 1.0f;
+	const float minor = 0.4f;
+
+	auto vertex = [&](int ring, int side) {
+		float u = glm::two_pi<float>() * ring / rings;
+		float v = glm::two_pi<float>() * side / sides;
+
+		glm::vec3 center(glm::cos(u) * major, 0.0f, glm::sin(u) * major);
+		glm::vec3 normal(glm::cos(u) * glm::cos(v), glm::sin(v), glm::sin(u) * glm::cos(v));
+		return Triangle::Vertex{
+			.normal = normal, .u = (float)ring / rings, .pos = center + normal * minor, .v = (float)side / sides
+		};
+	};
+
+	for (int ring = 0; ring < rings; ring++) {
+		for (int side = 0; side < sides; side++) {
+			auto v00 = vertex(ring, side);
+			auto v10 = vertex(ring + 1, side);
+			auto v01 = vertex(ring, side + 1);
+			auto v11 = vertex(ring + 1, side + 1);
+
+			triangles.push_back(Triangle(v00, v01, v10));
+			triangles.push_back(Triangle(v10, v01, v11));
+		}
+	}
+}
+
+SceneDescription mesh(const fs::path &file, int rings, int sides) {
+	SceneDescription scene;
+
+	scene.materials = {
+		Material(color::from_hex(0x777777)),
+		Material(color::from_hex(0x3070c0), 0.7f, 0.0f, 0.3f),
+	};
+	scene.materials[0].albedo_texture =
+		scene.textures.add_checker("checker", 256, 2, {{255, 255, 255, 255}}, {{96, 96, 96, 255}});
+
+	std::optional<ModelPair> indices;
+	if (file.extension() == ".stl") {
+		indices = load_stl_model(file, scene.triangles);
+	} else if (file.extension() == ".obj") {
+		indices = load_obj_model(file, scene.triangles);
+	}
+
+	if (!indices) {
+		if (!file.empty()) {
+			std::cerr << "Could not load " << file << ", using a generated torus\n";
+		}
+		create_torus(scene.triangles, rings, sides);
+		indices = ModelPair(0, scene.triangles.size());
+	}
+
+	Model model(scene.triangles, indices->first, indices->second);
+
+	// Fit the mesh in a 3 units cube resting on the ground
+	glm::vec3 extent = model.local_max - model.local_min;
+	float scale = 3.0f / glm::max(glm::max(extent.x, extent.y), glm::max(extent.z, 1e-6f));
+	glm::vec3 center = (model.local_min + model.local_max) * 0.5f;
+	model.transform = glm::translate(glm::vec3(0.0f, extent.y * scale * 0.5f - 1.0f, 0.0f))
+	                * glm::scale(glm::vec3(scale)) * glm::translate(-center);
+	model.compute_bounding_box();
+
+	scene.shapes = {
+		{0, Plane(glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f))},
+		{1, model},
+	};
+
+	scene.camera = {{0.0f, 1.5f, 4.5f}, 0.0f, -0.3f};
+
+	return scene;
+}
+
+SceneDescription glass() {
+	SceneDescription scene;
+	Box::create_triangle(scene.triangles);
+
+	scene.materials = {
+		Material(color::from_hex(0x777777)),
+		Material(color::white, 1.0f, 0.0f, 0.0f, 1.0f, 1.5f),
+		Material(color::from_hex(0xc0e0ff), 1.0f, 0.0f, 0.0f, 1.0f, 1.33f),
+		Material(color::from_hex(0xffd0d0), 0.9f, 0.0f, 0.0f, 1.0f, 2.4f),
+		Material(color::white, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, color::from_hex(0xffe0b0), 6.0f),
+	};
+
+	scene.shapes = {
+		{0, Plane(glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f))},
+		{1, Sphere(glm::vec3(-2.0f, 0.0f, 0.0f), 1.0f)},
+		{2, Sphere(glm::vec3(0.0f, 0.0f, -1.0f), 1.0f)},
+		{3, Sphere(glm::vec3(2.0f, -0.4f, 0.5f), 0.6f)},
+		{1, Box::model(glm::vec3(0.0f, -0.5f, 1.2f), glm::vec3(1.0f))},
+		{4, Sphere(glm::vec3(0.0f, 3.0f, -4.0f), 0.75f)},
+	};
+
+	scene.camera = {{0.0f, 1.0f, 5.0f}, 0.0f, -0.2f};
+
+	return scene;
+}
+
+std::vector<std::string> names() {
+	return {"spheres", "many_spheres", "cornell_box", "mesh", "glass"};
+}
+
+std::optional<SceneDescription> by_name(const std::string &name) {
+	if (name == "spheres")
+		return spheres();
+	if (name == "many_spheres")
+		return many_spheres();
+	if (name == "cornell_box")
+		return cornell_box();
+	if (name == "mesh")
+		return mesh();
+	if (name == "glass")
+		return glass();
+	return std::nullopt;
+}
+
+} // namespace scenes
@@ -1,3 +1,5 @@
+#include <glm/gtc/packing.hpp>
+
 #include "shape.hpp"
 #include "helper.hpp"
 
@@ -32,6 +34,45 @@ Triangle::Triangle(Vertex v0, Vertex v1, Vertex v2) {
 	this->vertices[2] = v2;
 }
 
+PackedTriangle::PackedTriangle() {
+	for (int i = 0; i < 3; i++) {
+		vertices[i] = {{{0, 0, 0, 0}}, {{0, 0, 0, 0}}};
+	}
+}
+
+/// Maps the unit sphere to [-1, 1]^2 by projecting it on an octahedron and unfolding the lower half
+static glm::vec2 encode_octahedral(glm::vec3 n) {
+	float length = glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+	if (length == 0.0f)
+		return glm::vec2(0.0f);
+
+	n /= length;
+	glm::vec2 e(n.x, n.y);
+	if (n.z < 0.0f) {
+		glm::vec2 sign(e.x >= 0.0f ? 1.0f : -1.0f, e.y >= 0.0f ? 1.0f : -1.0f);
+		e = (1.0f - glm::abs(glm::vec2(e.y, e.x))) * sign;
+	}
+	return e;
+}
+
+PackedTriangle::PackedTriangle(const Triangle &triangle, glm::vec3 local_min, glm::vec3 local_max) {
+	glm::vec3 extent = glm::max(local_max - local_min, glm::vec3(1e-20f));
+
+	for (int i = 0; i < 3; i++) {
+		auto &vertex = triangle.vertices[i];
+
+		glm::vec3 position = glm::round(glm::clamp((vertex.pos - local_min) / extent, 0.0f, 1.0f) * 65535.0f);
+		glm::vec2 normal = encode_octahedral(vertex.normal);
+
+		vertices[i].position = {{
+			(cl_ushort)position.x, (cl_ushort)position.y, (cl_ushort)position.z, glm::packHalf1x16(vertex.u)
+		}};
+		vertices[i].normal = {{
+			glm::packSnorm1x16(normal.x), glm::packSnorm1x16(normal.y), glm::packHalf1x16(vertex.v), 0
+		}};
+	}
+}
+
 Model::Model() {
 }
 Model::Model(const std::vector<Triangle> &triangles, cl_uint triangle_index, cl_uint num_triangles) {
@@ -39,24 +80,41 @@ Model::Model(const std::vector<Triangle> &triangles, cl_uint triangle_index, cl_
 	this->num_triangles = num_triangles;
 
 	this->transform = glm::mat4(1.0f); // identity
-	this->compute_bounding_box(triangles);
+	this->compute_local_bounds(triangles);
+	this->compute_bounding_box();
 }
 
-void Model::compute_bounding_box(const std::vector<Triangle> &triangles) {
-	bounding_min = glm::vec3(INFINITY);
-	bounding_max = glm::vec3(-INFINITY);
+void Model::compute_local_bounds(const std::vector<Triangle> &triangles) {
+	local_min = glm::vec3(INFINITY);
+	local_max = glm::vec3(-INFINITY);
 
 	for (uint i = 0; i < num_triangles; i++) {
 		auto &triangle = triangles[triangle_index + i];
 
 		for (uint j = 0; j < 3; j++) {
-			auto vertex = transform_vec3(transform, triangle.vertices[j].pos, true);
-			bounding_min = glm::min(bounding_min, vertex);
-			bounding_max = glm::max(bounding_max, vertex);
+			local_min = glm::min(local_min, triangle.vertices[j].pos);
+			local_max = glm::max(local_max, triangle.vertices[j].pos);
 		}
 	}
 }
 
+void Model::compute_bounding_box() {
+	bounding_min = glm::vec3(INFINITY);
+	bounding_max = glm::vec3(-INFINITY);
+
+	for (int i = 0; i < 8; i++) {
+		glm::vec3 corner = {
+			i & 1 ? local_max.x : local_min.x,
+			i & 2 ? local_max.y : local_min.y,
+			i & 4 ? local_max.z : local_min.z,
+		};
+
+		auto vertex = transform_vec3(transform, corner, true);
+		bounding_min = glm::min(bounding_min, vertex);
+		bounding_max = glm::max(bounding_max, vertex);
+	}
+}
+
 // void Model::move(glm::vec3 position) {
 // 	auto movement = position - this->position;
 // 	this->bounding_min += movement;
@@ -81,9 +139,10 @@ Model Box::model(const glm::vec3 &position, const glm::vec3 &size) {
 	Model model;
 	model.triangle_index = Box::triangle_index;
 	model.num_triangles = 12;
-	model.bounding_min = position - size * 0.5f;
-	model.bounding_max = position + size * 0.5f;
-	model.transform = glm::translate(position);
+	model.local_min = glm::vec3(-1.0f);
+	model.local_max = glm::vec3(1.0f);
+	model.transform = glm::translate(position) * glm::scale(size * 0.5f);
+	model.compute_bounding_box();
 
 	return model;
 }
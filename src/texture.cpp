@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#include <stb_image.h>
+
+#include "texture.hpp"
+
+int TextureAtlas::load(const fs::path &file) {
+	int width, height, channels;
+	stbi_set_flip_vertically_on_load(1);
+	uint8_t *pixels = stbi_load(file.c_str(), &width, &height, &channels, 4);
+	if (pixels == nullptr) {
+		return -1;
+	}
+
+	int index = add(file.filename().string(), width, height, pixels);
+	stbi_image_free(pixels);
+
+	return index;
+}
+
+static size_t tiles_along(int texels) {
+	return (texels + TextureAtlas::tile_size - 1) / TextureAtlas::tile_size;
+}
+
+/// Appends a level stored row by row to `texels` as tiles
+static void append_tiles(std::vector<cl_uchar4> &texels, const cl_uchar4 *level, int width, int height) {
+	size_t tiles_x = tiles_along(width), tiles_y = tiles_along(height);
+	for (size_t ty = 0; ty < tiles_y; ty++) {
+		for (size_t tx = 0; tx < tiles_x; tx++) {
+			size_t tile = texels.size();
+			texels.resize(tile + TextureAtlas::tile_texels, cl_uchar4{{0, 0, 0, 0}});
+
+			size_t x0 = tx * TextureAtlas::tile_size, y0 = ty * TextureAtlas::tile_size;
+			size_t columns = std::min<size_t>(TextureAtlas::tile_size, width - x0);
+			size_t rows = std::min<size_t>(TextureAtlas::tile_size, height - y0);
+			for (size_t y = 0; y < rows; y++) {
+				const cl_uchar4 *row = level + (y0 + y) * width + x0;
+				std::copy(row, row + columns, texels.begin() + tile + y * TextureAtlas::tile_size);
+			}
+		}
+	}
+}
+
+int TextureAtlas::add(const std::string &name, int width, int height, const uint8_t *pixels) {
+	Texture texture = {num_tiles(), width, height, 1};
+
+	const cl_uchar4 *level = (const cl_uchar4 *)pixels;
+	append_tiles(texels, level, width, height);
+
+	// Box filtered levels down to 1x1, odd sizes repeat their last row or column. Only the last
+	// level is kept row by row, to filter the next one.
+	std::vector<cl_uchar4> previous, next;
+	while (width > 1 || height > 1) {
+		int next_width = std::max(width / 2, 1);
+		int next_height = std::max(height / 2, 1);
+
+		next.resize((size_t)next_width * next_height);
+		for (int y = 0; y < next_height; y++) {
+			for (int x = 0; x < next_width; x++) {
+				int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+				int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+
+				cl_uchar4 &out = next[(size_t)y * next_width + x];
+				for (int c = 0; c < 4; c++) {
+					int sum = level[(size_t)y0 * width + x0].s[c] + level[(size_t)y0 * width + x1].s[c]
+					        + level[(size_t)y1 * width + x0].s[c] + level[(size_t)y1 * width + x1].s[c];
+					out.s[c] = (sum + 2) / 4;
+				}
+			}
+		}
+
+		previous.swap(next);
+		level = previous.data();
+		width = next_width;
+		height = next_height;
+		append_tiles(texels, level, width, height);
+		texture.num_levels++;
+	}
+
+	textures.push_back(texture);
+	names.push_back(name);
+
+	return textures.size() - 1;
+}
+
+int TextureAtlas::add_checker(const std::string &name, int size, int squares, cl_uchar4 a, cl_uchar4 b) {
+	std::vector<cl_uchar4> pixels((size_t)size * size);
+	int square = std::max(size / squares, 1);
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			pixels[y * size + x] = (x / square + y / square) % 2 == 0 ? a : b;
+		}
+	}
+
+	return add(name, size, size, (const uint8_t *)pixels.data());
+}
+
+TextureCache::TextureCache(const compute::context &context) {
+	buffer_textures = compute::buffer(context, 0);
+	buffer_page_table = compute::buffer(context, 0);
+	buffer_pool = compute::buffer(context, 0);
+	buffer_feedback = compute::buffer(context, 0);
+}
+
+void TextureCache::reset(const TextureAtlas &atlas, size_t budget, compute::command_queue &queue) {
+	// Uploads of the previous atlas read from its texels
+	queue.finish();
+	source = &atlas;
+
+	std::vector<VirtualTexture> textures;
+	std::vector<cl_uint> pinned_tiles;
+	for (auto &texture : atlas.textures) {
+		textures.push_back({(cl_uint)texture.first_tile, texture.width, texture.height, texture.num_levels});
+
+		size_t tile = texture.first_tile;
+		int width = texture.width, height = texture.height;
+		for (int level = 0; level < texture.num_levels; level++) {
+			size_t tiles_x = tiles_along(width), tiles_y = tiles_along(height);
+			if (tiles_x == 1 && tiles_y == 1) {
+				pinned_tiles.push_back(tile);
+			}
+
+			tile += tiles_x * tiles_y;
+			width = std::max(width / 2, 1);
+			height = std::max(height / 2, 1);
+		}
+	}
+
+	size_t num_slots = budget / (tile_texels * sizeof(cl_uchar4));
+	if (num_slots < pinned_tiles.size()) {
+		throw std::runtime_error(
+			"texture budget of " + std::to_string(budget >> 20) + " MiB can't hold the "
+			+ std::to_string(pinned_tiles.size()) + " coarse level tiles"
+		);
+	}
+	// No need for more slots than tiles
+	num_slots = std::min(num_slots, atlas.num_tiles());
+
+	page_table.assign(atlas.num_tiles(), not_resident);
+	slots.assign(num_slots, Slot());
+	feedback.assign(2 * page_table.size(), 0);
+	num_resident = 0;
+	num_missing = 0;
+
+	auto context = queue.get_context();
+	if (!textures.empty()) {
+		buffer_textures = compute::buffer(context, sizeof(VirtualTexture) * textures.size());
+		queue.enqueue_write_buffer(buffer_textures, 0, buffer_textures.size(), textures.data());
+
+		buffer_pool = compute::buffer(context, sizeof(cl_uchar4) * tile_texels * num_slots);
+		buffer_page_table = compute::buffer(context, sizeof(cl_uint) * page_table.size());
+		buffer_feedback = compute::buffer(context, feedback.size());
+		queue.enqueue_fill_buffer(buffer_feedback, &feedback[0], 1, 0, feedback.size());
+	}
+
+	for (size_t slot = 0; slot < pinned_tiles.size(); slot++) {
+		upload(queue, pinned_tiles[slot], slot);
+		slots[slot].pinned = true;
+	}
+
+	// Fill the rest of the pool up front, in reverse so the coarser levels of each texture come
+	// first. Everything is resident when the atlas fits in the budget.
+	size_t next_slot = pinned_tiles.size();
+	for (size_t tile = page_table.size(); tile-- > 0 && next_slot < num_slots;) {
+		if (page_table[tile] == not_resident) {
+			upload(queue, tile, next_slot++);
+		}
+	}
+	if (!page_table.empty()) {
+		queue.enqueue_write_buffer(buffer_page_table, 0, buffer_page_table.size(), page_table.data());
+	}
+}
+
+void TextureCache::upload(compute::command_queue &queue, cl_uint tile, cl_uint slot) {
+	Slot &previous = slots[slot];
+	if (previous.tile != not_resident) {
+		page_table[previous.tile] = not_resident;
+		num_resident--;
+	}
+
+	size_t size = sizeof(cl_uchar4) * tile_texels;
+	queue.enqueue_write_buffer_async(buffer_pool, slot * size, size, &source->texels[tile * tile_texels]);
+
+	page_table[tile] = slot;
+	slots[slot] = {tile, frame, false};
+	num_resident++;
+}
+
+bool TextureCache::stream(compute::command_queue &queue) {
+	if (page_table.empty())
+		return false;
+
+	frame++;
+
+	std::vector<cl_uint> missing;
+	std::vector<cl_uint> missed_by_camera;
+	for (cl_uint tile = 0; tile < page_table.size(); tile++) {
+		if (!feedback[2 * tile])
+			continue;
+
+		if (page_table[tile] != not_resident) {
+			slots[page_table[tile]].last_used = frame;
+		} else {
+			missing.push_back(tile);
+			if (feedback[2 * tile + 1]) {
+				missed_by_camera.push_back(tile);
+			}
+		}
+	}
+	num_missing = missing.size();
+
+	cl_uchar zero = 0;
+	queue.enqueue_fill_buffer(buffer_feedback, &zero, 1, 0, feedback.size());
+
+	if (missing.empty())
+		return false;
+
+	// The coarser levels of a texture come later in the page table, streaming them first
+	// improves the fallbacks sooner
+	std::sort(missing.begin(), missing.end(), std::greater<cl_uint>());
+
+	size_t uploads = 0;
+	for (cl_uint tile : missing) {
+		if (uploads == max_uploads)
+			break;
+
+		// Free slot, otherwise the least recently used tile that the last frame didn't sample
+		cl_uint best = not_resident;
+		for (cl_uint i = 0; i < slots.size(); i++) {
+			const Slot &slot = slots[i];
+			if (slot.tile == not_resident) {
+				best = i;
+				break;
+			}
+			if (slot.pinned || slot.last_used == frame)
+				continue;
+			if (best == not_resident || slot.last_used < slots[best].last_used) {
+				best = i;
+			}
+		}
+
+		// Everything resident is in use, the budget is too small for this frame
+		if (best == not_resident)
+			break;
+
+		upload(queue, tile, best);
+		uploads++;
+	}
+
+	if (uploads == 0)
+		return false;
+
+	// In order with the render kernel, and complete before `page_table` changes again since
+	// the frame is waited for
+	queue.enqueue_write_buffer_async(buffer_page_table, 0, buffer_page_table.size(), page_table.data());
+
+	// Restarting while the camera rays still miss tiles would only throw samples away again,
+	// when the budget is too small for them it would never converge
+	if (missed_by_camera.empty())
+		return false;
+	for (cl_uint tile : missed_by_camera) {
+		if (page_table[tile] == not_resident)
+			return false;
+	}
+	return true;
+}
+
+void TextureCache::read_feedback(compute::command_queue &queue) {
+	if (feedback.empty())
+		return;
+
+	queue.enqueue_read_buffer_async(buffer_feedback, 0, feedback.size(), feedback.data());
+}
@@ -1,48 +1,56 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <unordered_set>
+
+#include <unistd.h>
 
 #include "tracer.hpp"
 
+#include "render_cl.h"
+#include "skybox_png.h"
+
 static void rebuild_if_too_small(compute::buffer &buffer, size_t size) {
 	if (buffer.size() < size) {
 		buffer = compute::buffer(buffer.get_context(), size);
 	}
 }
 
-Tracer::Tracer(const int width, const int height) : options(width, height) {
-	// Get the default device
-	device = compute::system::default_device();
+Tracer::Tracer(const int width, const int height, const compute::device &device)
+	: device(device), band_end(height), options(width, height) {
 	std::cout << device.name() << " on " << device.vendor() << '\n';
 
 	// Create a context from the device
 	context = compute::context(device);
 
-	// Creates the program from source
-	try {
-		program = compute::program::create_with_source_file("src/render.cl", context);
-		program.build("-cl-std=CL2.0");
-	} catch (compute::program_build_failure &e) {
-		std::cerr << e.build_log() << '\n' << e.error_string() << '\n';
-		throw e;
-	}
-
-	// Creates the kernel
-	kernel = compute::kernel(program, "render");
-	average_kernel = compute::kernel(program, "average");
+	// The kernel source is embedded at build time, variants are compiled on demand
+	source = std::string((const char *)embedded::render_cl, sizeof(embedded::render_cl));
 
 	// Create command queue
-	queue = compute::command_queue(context, device);
+	// Profiling gives each stage its device time, at a negligible cost
+	queue = compute::command_queue(context, device, compute::command_queue::enable_profiling);
 
-	buffer_shapes = compute::buffer(context, 0);
+	buffer_spheres = compute::buffer(context, 0);
+	buffer_planes = compute::buffer(context, 0);
+	buffer_models = compute::buffer(context, 0);
+	buffer_shape_materials = compute::buffer(context, 0);
+	texture_cache = TextureCache(context);
+	geometry_cache = GeometryCache(context);
 	buffer_triangles = compute::buffer(context, 0);
 	buffer_materials = compute::buffer(context, 0);
+	buffer_stats = compute::buffer(context, sizeof(host_stats));
 
-	render_canvas = compute::buffer(context, sizeof(cl_float3) * width * height);
-	render_output = compute::buffer(context, sizeof(cl_uchar4) * width * height);
+	allocate_targets();
 
-	FILE *skybox_file = fopen("assets/skybox.png", "r");
 	int channels, w, h;
 	stbi_set_flip_vertically_on_load(1);
-	float *skybox_image = stbi_loadf_from_file(skybox_file, &w, &h, &channels, 4);
+	float *skybox_image = stbi_loadf_from_memory(
+		embedded::skybox_png, sizeof(embedded::skybox_png), &w, &h, &channels, 4
+	);
 
 	skybox = compute::image2d(context, w, h, compute::image_format(CL_RGBA, CL_FLOAT));
 	sampler = compute::image_sampler(context, true, CL_ADDRESS_CLAMP_TO_EDGE, CL_FILTER_LINEAR);
@@ -52,65 +60,977 @@ Tracer::Tracer(const int width, const int height) : options(width, height) {
 	queue.enqueue_write_image(skybox, origin, region, skybox_image);
 
 	stbi_image_free(skybox_image);
-	fclose(skybox_file);
 
 
-	// Set arguments
-	kernel.set_arg(2, render_canvas);
-	kernel.set_arg(3, buffer_shapes);
-	kernel.set_arg(4, buffer_triangles);
-	kernel.set_arg(5, buffer_materials);
-	kernel.set_arg(6, skybox);
-	kernel.set_arg(7, sampler);
+	// Creates the kernels and sets their arguments
+	use_variant(build_options());
+}
 
-	average_kernel.set_arg(1, render_canvas);
-	average_kernel.set_arg(2, render_output);
+std::string Tracer::build_options() const {
+	std::string build = "-cl-std=CL2.0";
+
+	if (!scene_has_shape[SHAPE_SPHERE])
+		build += " -DNO_SPHERES";
+	if (!scene_has_shape[SHAPE_PLANE])
+		build += " -DNO_PLANES";
+	if (!scene_has_shape[SHAPE_MODEL])
+		build += " -DNO_MODELS";
+	if (compress_meshes && scene_has_shape[SHAPE_MODEL])
+		build += " -DCOMPRESSED_MESHES";
+	if (geometry_paged)
+		build += " -DPAGED_GEOMETRY";
+	if (materials_global)
+		build += " -DMATERIALS_GLOBAL";
+	if (!scene_has_textures)
+		build += " -DNO_TEXTURES";
+
+	if (options.show_normals)
+		build += " -DNORMALS_ONLY";
+	if (specialize_bounces)
+		build += " -DNUM_BOUNCES=" + std::to_string(options.num_bounces);
+	if (cost_heatmap)
+		build += " -DCOST_HEATMAP";
+	if (ray_stats)
+		build += " -DRAY_STATS";
+
+	return build;
+}
+
+/// 64 bit FNV-1a, stable across runs and compilers unlike std::hash
+static uint64_t fnv1a(const std::string &data, uint64_t hash = 0xcbf29ce484222325) {
+	for (unsigned char c : data) {
+		hash ^= c;
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+fs::path Tracer::default_binary_cache_dir() {
+	if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0')
+		return fs::path(xdg) / "simple-raytracer";
+	if (const char *home = std::getenv("HOME"); home != nullptr && *home != '\0')
+		return fs::path(home) / ".cache" / "simple-raytracer";
+	return {};
+}
+
+compute::program Tracer::build_program(const std::string &build_options) {
+	fs::path cache_file;
+	if (!binary_cache_dir.empty()) {
+		// Anything that can change the generated code is part of the key
+		uint64_t key = fnv1a(device.name());
+		key = fnv1a(device.vendor(), key);
+		key = fnv1a(device.driver_version(), key);
+		key = fnv1a(device.platform().version(), key);
+		key = fnv1a(source, key);
+		key = fnv1a(build_options, key);
+
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+		cache_file = binary_cache_dir / name;
+
+		std::ifstream file(cache_file, std::ios::binary);
+		if (file) {
+			std::vector<unsigned char> binary(
+				(std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()
+			);
+
+			try {
+				auto program = compute::program::create_with_binary(binary, context);
+				program.build(build_options);
+				return program;
+			} catch (compute::opencl_error &e) {
+				// Stale or corrupted binary, rebuild it from source
+				std::cerr << "Ignoring cached program " << cache_file << ": " << e.what() << '\n';
+			}
+		}
+	}
+
+	compute::program program;
+	try {
+		program = compute::program::create_with_source(source, context);
+		program.build(build_options);
+	} catch (compute::program_build_failure &e) {
+		std::cerr << e.build_log() << '\n' << e.error_string() << '\n';
+		throw e;
+	}
+
+	if (!cache_file.empty()) {
+		// Write to a temporary file first, so concurrent jobs never read a partial binary
+		std::error_code error;
+		fs::create_directories(binary_cache_dir, error);
+
+		fs::path temporary = cache_file;
+		temporary += "." + std::to_string(getpid()) + ".tmp";
+
+		auto binary = program.binary();
+		std::ofstream file(temporary, std::ios::binary);
+		file.write((const char *)binary.data(), binary.size());
+		file.close();
+
+		if (file) {
+			fs::rename(temporary, cache_file, error);
+		}
+		if (!file || error) {
+			fs::remove(temporary, error);
+		}
+	}
+
+	return program;
+}
+
+void Tracer::use_variant(const std::string &build_options) {
+	if (build_options == current_variant)
+		return;
+
+	auto it = variants.find(build_options);
+	if (it == variants.end()) {
+		Variant variant;
+		variant.program = build_program(build_options);
+
+		variant.render = compute::kernel(variant.program, "render");
+		variant.average = compute::kernel(variant.program, "average");
+		variant.reproject = compute::kernel(variant.program, "reproject");
+		variant.heatmap = compute::kernel(variant.program, "heatmap");
+
+		it = variants.emplace(build_options, variant).first;
+	}
+
+	kernel = it->second.render;
+	average_kernel = it->second.average;
+	reproject_kernel = it->second.reproject;
+	heatmap_kernel = it->second.heatmap;
+	current_variant = build_options;
+
+	bind_arguments();
+}
+
+/// Meshes used by the models, each once since instances share their triangles and bounds
+static std::vector<Tracer::MeshRange> mesh_ranges(const std::vector<Shape> &shapes) {
+	std::vector<Tracer::MeshRange> meshes;
+	std::unordered_set<cl_uint> done;
+	for (auto &shape : shapes) {
+		if (shape.type != SHAPE_MODEL)
+			continue;
+
+		auto &model = shape.shape.model;
+		if (done.insert(model.triangle_index).second) {
+			meshes.push_back({model.triangle_index, model.num_triangles, model.local_min, model.local_max});
+		}
+	}
+	return meshes;
+}
+
+/// Quantizes the triangles of every mesh over its object space bounds, the triangles no model
+/// uses are left zeroed
+static std::vector<PackedTriangle> compress_triangles(
+	const std::vector<Tracer::MeshRange> &meshes, const std::vector<Triangle> &triangles
+) {
+	std::vector<PackedTriangle> packed(triangles.size());
+
+	for (auto &mesh : meshes) {
+		for (cl_uint i = 0; i < mesh.num_triangles; i++) {
+			size_t index = mesh.triangle_index + i;
+			packed[index] = PackedTriangle(triangles[index], mesh.local_min, mesh.local_max);
+		}
+	}
+
+	return packed;
 }
 
 void Tracer::update_scene(
 	const std::vector<Shape> &shapes, const std::vector<Triangle> &triangles, const std::vector<Material> &materials
 ) {
-	if (shapes.size() > 0) {
-		auto size = sizeof(Shape) * shapes.size();
-		rebuild_if_too_small(buffer_shapes, size);
-		queue.enqueue_write_buffer(buffer_shapes, 0, size, shapes.data());
+	// The kernel tests each type in its own loop over a compact array, instead of branching on
+	// the type of every Shape, which is as large as a Model
+	std::vector<cl_float4> spheres;
+	std::vector<cl_float4> planes;
+	std::vector<Model> models;
+	std::vector<cl_int> sphere_materials, plane_materials, model_materials;
+
+	for (auto &shape : shapes) {
+		if (shape.type == SHAPE_SPHERE) {
+			auto &sphere = shape.shape.sphere;
+			spheres.push_back({{sphere.position.x, sphere.position.y, sphere.position.z, sphere.radius}});
+			sphere_materials.push_back(shape.material);
+		} else if (shape.type == SHAPE_PLANE) {
+			auto &plane = shape.shape.plane;
+			float distance = glm::dot(plane.normal, plane.position);
+			planes.push_back({{plane.normal.x, plane.normal.y, plane.normal.z, distance}});
+			plane_materials.push_back(shape.material);
+		} else if (shape.type == SHAPE_MODEL) {
+			models.push_back(shape.shape.model);
+			model_materials.push_back(shape.material);
+		}
 	}
-	if (triangles.size() > 0) {
-		auto size = sizeof(Triangle) * triangles.size();
-		rebuild_if_too_small(buffer_triangles, size);
-		queue.enqueue_write_buffer(buffer_triangles, 0, size, triangles.data());
+
+	// Meshes that don't fit in the budget, or in a single allocation, are split in pages
+	// streamed in by the frames
+	size_t triangle_size = compress_meshes ? sizeof(PackedTriangle) : sizeof(Triangle);
+	size_t triangles_size = triangle_size * triangles.size();
+	size_t max_alloc = device.get_info<cl_ulong>(CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+	geometry_paged = !models.empty() && (triangles_size > geometry_budget || triangles_size > max_alloc);
+	if (geometry_paged) {
+		// Only the pages that fit are uploaded, the models then point to their bounds
+		auto start = Profiler::Clock::now();
+		geometry_cache.reset(shapes, triangles, compress_meshes, geometry_budget, queue);
+		geometry_cache.place(models, queue);
+		if (profiler) {
+			profiler->record("Geometry pages upload", start, Profiler::Clock::now());
+		}
+	}
+
+	// Same order as the loops of the kernel
+	std::vector<cl_int> shape_materials = sphere_materials;
+	shape_materials.insert(shape_materials.end(), plane_materials.begin(), plane_materials.end());
+	shape_materials.insert(shape_materials.end(), model_materials.begin(), model_materials.end());
+
+	auto upload_shapes = [this](compute::buffer &buffer, const void *data, size_t size) {
+		if (size == 0)
+			return;
+
+		rebuild_if_too_small(buffer, size);
+		auto enqueued = Profiler::Clock::now();
+		auto event = queue.enqueue_write_buffer(buffer, 0, size, data);
+		record_event("Shapes upload", event, enqueued);
+	};
+	upload_shapes(buffer_spheres, spheres.data(), sizeof(cl_float4) * spheres.size());
+	upload_shapes(buffer_planes, planes.data(), sizeof(cl_float4) * planes.size());
+	upload_shapes(buffer_models, models.data(), sizeof(Model) * models.size());
+	upload_shapes(buffer_shape_materials, shape_materials.data(), sizeof(cl_int) * shape_materials.size());
+
+	if (geometry_paged) {
+		// The kernel reads the triangles from the pool of pages instead
+		buffer_triangles = compute::buffer(context, 0);
+		compressed_meshes.clear();
+	} else if (triangles.size() > 0) {
+		std::vector<PackedTriangle> packed;
+		bool upload = true;
+		if (compress_meshes) {
+			// The scene is updated whenever the camera moves, quantizing the same meshes again
+			// would dominate the frame on large meshes
+			auto meshes = mesh_ranges(shapes);
+			upload = meshes != compressed_meshes || triangles.size() != compressed_triangles
+			      || buffer_triangles.size() != triangles_size;
+			if (upload) {
+				packed = compress_triangles(meshes, triangles);
+				compressed_meshes = meshes;
+				compressed_triangles = triangles.size();
+			}
+		} else {
+			compressed_meshes.clear();
+		}
+
+		if (upload) {
+			const void *data = compress_meshes ? (const void *)packed.data() : triangles.data();
+
+			// Reallocated to the exact size, so compressing actually frees device memory
+			if (buffer_triangles.size() != triangles_size) {
+				buffer_triangles = compute::buffer(context, triangles_size);
+			}
+			auto enqueued = Profiler::Clock::now();
+			auto event = queue.enqueue_write_buffer(buffer_triangles, 0, triangles_size, data);
+			record_event("Triangles upload", event, enqueued);
+		}
 	}
 	if (materials.size() > 0) {
-		auto size = sizeof(Material) * materials.size();
-		rebuild_if_too_small(buffer_materials, size);
-		queue.enqueue_write_buffer(buffer_materials, 0, size, materials.data());
+		std::vector<PackedMaterial> packed(materials.begin(), materials.end());
+
+		auto size = sizeof(PackedMaterial) * packed.size();
+		// Exact size, the whole buffer is bound and has to fit the constant memory below
+		if (buffer_materials.size() != size) {
+			buffer_materials = compute::buffer(context, size);
+		}
+		auto enqueued = Profiler::Clock::now();
+		auto event = queue.enqueue_write_buffer(buffer_materials, 0, size, packed.data());
+		record_event("Materials upload", event, enqueued);
+
+		// Every shading reads the table, so it goes through the constant cache when it fits
+		materials_global = size > device.get_info<cl_ulong>(CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE);
+	}
+
+	scene_has_shape[SHAPE_SPHERE] = !spheres.empty();
+	scene_has_shape[SHAPE_PLANE] = !planes.empty();
+	scene_has_shape[SHAPE_MODEL] = !models.empty();
+
+	scene_data.num_spheres = spheres.size();
+	scene_data.num_planes = planes.size();
+	scene_data.num_models = models.size();
+
+	// Point to new buffers
+	bind_arguments();
+
+	for (auto &peer : secondary) {
+		sync_settings(*peer);
+		peer->update_scene(shapes, triangles, materials);
+	}
+}
+
+void Tracer::update_textures(const TextureAtlas &atlas) {
+	// Only the coarse levels are uploaded, the rest is streamed in by the frames
+	auto start = Profiler::Clock::now();
+	texture_cache.reset(atlas, texture_budget, queue);
+	if (profiler) {
+		profiler->record("Textures upload", start, Profiler::Clock::now());
 	}
 
+	scene_has_textures = atlas.size() > 0;
+
 	// Point to new buffers
-	kernel.set_arg(3, buffer_shapes);
-	kernel.set_arg(4, buffer_triangles);
-	kernel.set_arg(5, buffer_materials);
+	bind_arguments();
 
-	scene_data.num_shapes = shapes.size();
+	for (auto &peer : secondary) {
+		sync_settings(*peer);
+		peer->update_textures(atlas);
+	}
+}
+
+/// Offset of the sample counts of a half canvas in uints, after the means rounded up to a uint.
+/// Same as in the kernel.
+static size_t half_canvas_counts(size_t num_pixels) {
+	return (num_pixels * 3 + 1) / 2;
+}
+
+size_t Tracer::canvas_size() const {
+	size_t num_pixels = (size_t)options.width * options.height;
+	if (options.half_canvas) {
+		return sizeof(cl_uint) * (half_canvas_counts(num_pixels) + num_pixels);
+	}
+	return sizeof(cl_float4) * num_pixels;
+}
+
+void Tracer::allocate_targets() {
+	size_t num_pixels = options.width * options.height;
+
+	render_canvas = compute::buffer(context, canvas_size());
+	render_output = compute::buffer(context, sizeof(cl_uchar4) * num_pixels);
+	render_depth = compute::buffer(context, sizeof(cl_float) * num_pixels);
+	render_albedo = compute::buffer(context, sizeof(cl_float4) * num_pixels);
+	render_normals = compute::buffer(context, sizeof(cl_float4) * num_pixels);
+	denoised_canvas = compute::buffer(context, sizeof(cl_float4) * num_pixels);
+	render_cost = compute::buffer(context, sizeof(cl_uint4) * num_pixels);
+
+	history_canvas = compute::buffer(context, canvas_size());
+	history_depth = compute::buffer(context, sizeof(cl_float) * num_pixels);
+
+	// Empty history has a sample count of 0, so it is never merged
+	float pattern = 0.f;
+	queue.enqueue_fill_buffer(history_canvas, &pattern, sizeof(float), 0, history_canvas.size());
+	queue.enqueue_fill_buffer(history_depth, &pattern, sizeof(float), 0, history_depth.size());
+	pending_reprojection = false;
+
+	reset_canvas();
+}
+
+void Tracer::bind_arguments() {
 	kernel.set_arg(1, sizeof(SceneData), &scene_data);
+	kernel.set_arg(2, render_canvas);
+	kernel.set_arg(3, buffer_spheres);
+	kernel.set_arg(4, buffer_planes);
+	kernel.set_arg(5, buffer_models);
+	kernel.set_arg(6, buffer_shape_materials);
+	kernel.set_arg(7, geometry_paged ? geometry_cache.buffer_pool : buffer_triangles);
+	kernel.set_arg(8, buffer_materials);
+	kernel.set_arg(9, texture_cache.buffer_textures);
+	kernel.set_arg(10, texture_cache.buffer_page_table);
+	kernel.set_arg(11, texture_cache.buffer_pool);
+	kernel.set_arg(12, texture_cache.buffer_feedback);
+	kernel.set_arg(13, geometry_cache.buffer_bounds);
+	kernel.set_arg(14, geometry_cache.buffer_page_table);
+	kernel.set_arg(15, geometry_cache.buffer_feedback);
+	kernel.set_arg(16, skybox);
+	kernel.set_arg(17, sampler);
+	kernel.set_arg(18, render_output);
+	kernel.set_arg(19, render_depth);
+	kernel.set_arg(20, render_albedo);
+	kernel.set_arg(21, render_normals);
+	kernel.set_arg(22, render_cost);
+	kernel.set_arg(23, buffer_stats);
+
+	average_kernel.set_arg(1, render_canvas);
+	average_kernel.set_arg(2, render_output);
+
+	reproject_kernel.set_arg(2, render_canvas);
+	reproject_kernel.set_arg(3, render_depth);
+	reproject_kernel.set_arg(4, history_canvas);
+	reproject_kernel.set_arg(5, history_depth);
+	reproject_kernel.set_arg(6, render_output);
+
+	heatmap_kernel.set_arg(1, render_cost);
+	heatmap_kernel.set_arg(4, render_output);
+}
+
+/// Converts an IEEE 754 half to a float
+static float half_to_float(uint16_t h) {
+	uint32_t sign = (h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1F;
+	uint32_t mantissa = h & 0x3FF;
+
+	uint32_t bits;
+	if (exponent == 0x1F) { // inf / nan
+		bits = sign | 0x7F800000 | (mantissa << 13);
+	} else if (exponent != 0) { // normal
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	} else if (mantissa != 0) { // subnormal, renormalize
+		exponent = 113;
+		while (!(mantissa & 0x400)) {
+			mantissa <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+	} else { // zero
+		bits = sign;
+	}
+
+	float f;
+	std::memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+void Tracer::read_canvas_pixels(size_t first, size_t count, glm::vec4 *output) {
+	if (options.half_canvas) {
+		std::vector<uint16_t> halves(count * 3);
+		std::vector<cl_uint> counts(count);
+		queue.enqueue_read_buffer(
+			render_canvas, first * 3 * sizeof(uint16_t), halves.size() * sizeof(uint16_t), halves.data()
+		);
+		size_t counts_offset = half_canvas_counts((size_t)options.width * options.height) + first;
+		queue.enqueue_read_buffer(
+			render_canvas, counts_offset * sizeof(cl_uint), counts.size() * sizeof(cl_uint), counts.data()
+		);
+		for (size_t i = 0; i < count; i++) {
+			for (int c = 0; c < 3; c++) {
+				output[i][c] = half_to_float(halves[i * 3 + c]);
+			}
+			output[i].w = counts[i];
+		}
+	} else {
+		queue.enqueue_read_buffer(render_canvas, first * sizeof(cl_float4), count * sizeof(cl_float4), output);
+	}
+}
+
+void Tracer::read_canvas(std::vector<glm::vec4> &canvas) {
+	size_t first_pixel = (size_t)band_begin * options.width;
+	canvas.resize((size_t)(band_end - band_begin) * options.width);
+	read_canvas_pixels(first_pixel, canvas.size(), canvas.data());
+}
+
+void Tracer::read_cost() {
+	band_cost = CostTotals();
+	if (band_end <= band_begin)
+		return;
+
+	size_t first_pixel = (size_t)band_begin * options.width;
+	size_t num_pixels = (size_t)(band_end - band_begin) * options.width;
+
+	host_cost.resize(num_pixels);
+	queue.enqueue_read_buffer(
+		render_cost, first_pixel * sizeof(cl_uint4), num_pixels * sizeof(cl_uint4), host_cost.data()
+	);
+
+	band_cost.num_pixels = num_pixels;
+	for (auto &counters : host_cost) {
+		for (int metric = 0; metric < 4; metric++) {
+			band_cost.total[metric] += counters.s[metric];
+			band_cost.max[metric] = glm::max(band_cost.max[metric], counters.s[metric]);
+		}
+	}
+}
+
+void Tracer::scale_heatmap() {
+	// Every frame is enqueued already, the blocking reads don't hold back the other devices
+	read_cost();
+	for (auto &peer : secondary) {
+		peer->read_cost();
+	}
+
+	// Scaled to the most expensive pixel of the whole frame, so the bands match
+	heatmap_scale = cost_totals().max[heatmap_metric];
+	for (auto &peer : secondary) {
+		peer->heatmap_scale = heatmap_scale;
+	}
+}
+
+void Tracer::draw_heatmap() {
+	size_t first_pixel = (size_t)band_begin * options.width;
+	size_t num_pixels = (size_t)(band_end - band_begin) * options.width;
+
+	cl_int metric = heatmap_metric;
+	heatmap_kernel.set_arg(0, sizeof(RenderData), &options);
+	heatmap_kernel.set_arg(2, sizeof(cl_int), &metric);
+	heatmap_kernel.set_arg(3, sizeof(cl_float), &heatmap_scale);
+	record_event("Heatmap kernel", queue.enqueue_1d_range_kernel(heatmap_kernel, first_pixel, num_pixels, 0));
+}
+
+CostTotals Tracer::cost_totals() const {
+	CostTotals totals = band_cost;
+	for (auto &peer : secondary) {
+		CostTotals peer_totals = peer->cost_totals();
+		totals.num_pixels += peer_totals.num_pixels;
+		for (int metric = 0; metric < 4; metric++) {
+			totals.total[metric] += peer_totals.total[metric];
+			totals.max[metric] = glm::max(totals.max[metric], peer_totals.max[metric]);
+		}
+	}
+	return totals;
+}
+
+RayStats &RayStats::operator+=(const RayStats &other) {
+	primary_rays += other.primary_rays;
+	bounce_rays += other.bounce_rays;
+	sky_escapes += other.sky_escapes;
+	terminated_paths += other.terminated_paths;
+	sphere_tests += other.sphere_tests;
+	plane_tests += other.plane_tests;
+	model_tests += other.model_tests;
+	triangle_tests += other.triangle_tests;
+	return *this;
+}
+
+RayStats Tracer::stats() const {
+	RayStats stats;
+	if (stats_counted) {
+		cl_ulong totals[num_ray_stats];
+		for (int i = 0; i < num_ray_stats; i++) {
+			totals[i] = host_stats[2 * i] | (cl_ulong)host_stats[2 * i + 1] << 32;
+		}
+
+		// Same order as the Cost struct of the kernel
+		stats.primary_rays = totals[0];
+		stats.bounce_rays = totals[1] - totals[0];
+		stats.sky_escapes = totals[2];
+		stats.terminated_paths = totals[0] - totals[2];
+		stats.sphere_tests = totals[3];
+		stats.plane_tests = totals[4];
+		stats.model_tests = totals[5];
+		stats.triangle_tests = totals[6];
+	}
+
+	for (auto &peer : secondary) {
+		stats += peer->stats();
+	}
+	return stats;
+}
+
+void Tracer::denoise_canvas() {
+	// Only the band of this device, the filter stops at its edges like at the edges of the image
+	size_t first_pixel = (size_t)band_begin * options.width;
+	size_t num_pixels = (size_t)(band_end - band_begin) * options.width;
+
+	host_canvas.resize(num_pixels);
+	host_albedo.resize(num_pixels);
+	host_normals.resize(num_pixels);
+	host_depth.resize(num_pixels);
+
+	read_canvas_pixels(first_pixel, num_pixels, host_canvas.data());
+	queue.enqueue_read_buffer(
+		render_albedo, first_pixel * sizeof(cl_float4), num_pixels * sizeof(cl_float4), host_albedo.data()
+	);
+	queue.enqueue_read_buffer(
+		render_normals, first_pixel * sizeof(cl_float4), num_pixels * sizeof(cl_float4),
+		host_normals.data()
+	);
+	queue.enqueue_read_buffer(
+		render_depth, first_pixel * sizeof(cl_float), num_pixels * sizeof(cl_float), host_depth.data()
+	);
+
+	denoiser.denoise(
+		options.width, band_end - band_begin, host_canvas, host_albedo, host_normals, host_depth,
+		host_denoised
+	);
+
+	queue.enqueue_write_buffer(
+		denoised_canvas, first_pixel * sizeof(cl_float4), num_pixels * sizeof(cl_float4),
+		host_denoised.data()
+	);
+}
+
+void Tracer::resize(const int width, const int height) {
+	options.width = width;
+	options.height = height;
+
+	allocate_targets();
+	bind_arguments();
+
+	for (auto &peer : secondary) {
+		peer->resize(width, height);
+	}
+	balance_bands();
 }
 
 void Tracer::clear_canvas() {
+	reset_canvas();
+
+	for (auto &peer : secondary) {
+		peer->clear_canvas();
+	}
+}
+
+void Tracer::set_band(int begin, int end) {
+	if (!secondary.empty()) {
+		throw std::runtime_error("the bands are managed by the tracer when using several devices");
+	}
+
+	band_begin = glm::clamp(begin, 0, options.height);
+	band_end = glm::clamp(end, band_begin, options.height);
+}
+
+void Tracer::seek(cl_uint frame) {
+	frame_index = frame;
+}
+
+void Tracer::reset_canvas() {
 	float pattern = 0.f;
 	queue.enqueue_fill_buffer(render_canvas, &pattern, sizeof(float), 0, render_canvas.size());
+	pending_reprojection = false;
+	frame_index = 0;
+}
+
+void Tracer::reproject() {
+	for (auto &peer : secondary) {
+		peer->reproject();
+	}
+
+	// The history needs to match the current canvas format
+	if (!reprojection || previewing || history_canvas.size() != render_canvas.size()) {
+		reset_canvas();
+		return;
+	}
+
+	std::swap(render_canvas, history_canvas);
+	std::swap(render_depth, history_depth);
+	bind_arguments();
+
+	// Keep the frame index going, so new samples don't repeat the ones in the history
+	float pattern = 0.f;
+	queue.enqueue_fill_buffer(render_canvas, &pattern, sizeof(float), 0, render_canvas.size());
+
+	reprojection_data.world_to_camera = glm::inverse(options.camera_to_world);
+	reprojection_data.aspect_ratio = options.aspect_ratio;
+	reprojection_data.fov_scale = options.fov_scale;
+	pending_reprojection = true;
 }
 
 void Tracer::render(cl_uint ticks_stopped, std::vector<uint8_t> &output) {
+	if (!secondary.empty()) {
+		render_split(ticks_stopped, output);
+		report_events();
+		return;
+	}
+
+	enqueue_frame(ticks_stopped);
+	if (cost_heatmap) {
+		scale_heatmap();
+	}
+	finish_frame(output);
+	readback_event.wait();
+	report_events();
+}
+
+void Tracer::record_event(
+	const char *stage, const compute::event &event, Profiler::Clock::time_point enqueued
+) {
+	if (profiler) {
+		pending_events.push_back({stage, event, enqueued});
+	}
+}
+
+void Tracer::report_events() {
+	if (!profiler) {
+		pending_events.clear();
+		return;
+	}
+
+	// The queue is in order, every event before the readback is complete
+	for (auto &pending : pending_events) {
+		profiler->record(pending.stage, pending.event, pending.enqueued);
+	}
+	pending_events.clear();
+}
+
+void Tracer::enqueue_frame(cl_uint ticks_stopped) {
+	// Empty band, only possible with fewer rows than devices. Zero sized commands are invalid.
+	if (band_end <= band_begin) {
+		frame_event = queue.enqueue_marker();
+		return;
+	}
+
+	// Canvas precision changed, the old samples are in the wrong format anyway
+	if (render_canvas.size() != canvas_size()) {
+		allocate_targets();
+		bind_arguments();
+	}
+
+	// Recompiles if the scene or settings need another variant
+	use_variant(build_options());
+
+	// Trace at a fraction of the resolution while the camera moves, unless the history can be
+	// reused instead
+	bool preview = !reprojection && preview_scale > 1 && ticks_stopped <= preview_frames;
+	if (previewing && !preview) {
+		// Don't keep blocky samples once the camera rests
+		reset_canvas();
+	}
+	previewing = preview;
+
+	options.downscale = preview ? preview_scale : 1;
+
+	// The feedback of the previous frame is complete, it was read before its output. Streamed
+	// before the frame index is taken, since it may restart the canvas.
+	if (scene_has_textures) {
+		auto start = Profiler::Clock::now();
+		if (texture_cache.stream(queue)) {
+			// The camera rays shaded tiles with coarser levels, and can sample all of them now
+			reset_canvas();
+		}
+		if (profiler) {
+			profiler->record("Texture streaming", start, Profiler::Clock::now());
+		}
+	}
+	if (geometry_paged) {
+		auto start = Profiler::Clock::now();
+		// Samples that needed missing pages were dropped, the others are kept
+		bool was_too_small = geometry_cache.budget_too_small();
+		geometry_cache.stream(queue);
+		if (geometry_cache.budget_too_small() && !was_too_small) {
+			std::cerr << "Geometry budget too small for the pages crossed by a frame, some pixels "
+			             "won't converge. Raise --geometry-budget.\n";
+		}
+		if (profiler) {
+			profiler->record("Geometry streaming", start, Profiler::Clock::now());
+		}
+	}
+
+	// The denoiser runs on the raw samples, so tonemapping has to wait
+	RenderData &data = frame_data;
+	data = options;
+	data.frame = frame_index++;
+	if (deterministic) {
+		data.time = 0;
+	}
+	data.write_aovs = denoise;
+	if (denoise) {
+		data.fuse_tonemap = false;
+	}
+
+	size_t band_height = band_end - band_begin;
+
+	stats_counted = ray_stats;
+	if (ray_stats) {
+		cl_uint zero = 0;
+		queue.enqueue_fill_buffer(buffer_stats, &zero, sizeof(zero), 0, sizeof(host_stats));
+	}
+
 	// Raytrace to canvas
-	kernel.set_arg(0, sizeof(RenderData), &options);
+	kernel.set_arg(0, sizeof(RenderData), &data);
+
+	// Blocks overlapping the band
+	size_t scale = options.downscale;
+	size_t offset[2] = { 0, band_begin / scale };
+	size_t size[2] = {
+		(options.width + scale - 1) / scale,
+		(band_end + scale - 1) / scale - offset[1]
+	};
+	record_event("Render kernel", queue.enqueue_nd_range_kernel(kernel, 2, offset, size, NULL));
+
+	// Done before the readback of the output, which `render` waits for
+	if (ray_stats) {
+		queue.enqueue_read_buffer_async(buffer_stats, 0, sizeof(host_stats), host_stats);
+	}
+	if (scene_has_textures) {
+		texture_cache.read_feedback(queue);
+	}
+	if (geometry_paged) {
+		geometry_cache.read_feedback(queue);
+	}
 
-	size_t size[2] = { (size_t)options.width, (size_t)options.height };
-	queue.enqueue_nd_range_kernel(kernel, 2, NULL, size, NULL);
+	// Merge the samples of the previous camera position
+	if (pending_reprojection) {
+		reprojection_data.depth_tolerance = depth_tolerance;
+		reprojection_data.max_history = max_history;
 
-	// Average with the last samples
-	average_kernel.set_arg(0, sizeof(cl_uint), &ticks_stopped);
-	queue.enqueue_1d_range_kernel(average_kernel, 0, options.width * options.height, 0);
+		reproject_kernel.set_arg(0, sizeof(RenderData), &data);
+		reproject_kernel.set_arg(1, sizeof(ReprojectionData), &reprojection_data);
+
+		size_t band_offset[2] = { 0, (size_t)band_begin };
+		size_t band_size[2] = { (size_t)options.width, band_height };
+		record_event(
+			"Reproject kernel",
+			queue.enqueue_nd_range_kernel(reproject_kernel, 2, band_offset, band_size, NULL)
+		);
+		pending_reprojection = false;
+	}
+
+	frame_event = queue.enqueue_marker();
+	queue.flush();
+}
+
+void Tracer::finish_frame(std::vector<uint8_t> &output) {
+	if (band_end <= band_begin) {
+		readback_event = queue.enqueue_marker();
+		return;
+	}
+
+	RenderData data = frame_data;
+
+	if (denoise && !cost_heatmap) {
+		auto start = Profiler::Clock::now();
+		denoise_canvas();
+		if (profiler) {
+			// Includes waiting for the render kernel, the readbacks are blocking
+			profiler->record("Denoise", start, Profiler::Clock::now());
+		}
+	}
+
+	size_t first_pixel = (size_t)band_begin * options.width;
+	size_t num_pixels = (size_t)(band_end - band_begin) * options.width;
+
+	// Tonemap the accumulated samples, unless the render kernel already did it
+	if (cost_heatmap) {
+		draw_heatmap();
+	} else if (!data.fuse_tonemap) {
+		if (denoise) {
+			data.half_canvas = false; // the denoised canvas is always float4
+		}
+		average_kernel.set_arg(0, sizeof(RenderData), &data);
+		average_kernel.set_arg(1, denoise ? denoised_canvas : render_canvas);
+		record_event(
+			"Average kernel", queue.enqueue_1d_range_kernel(average_kernel, first_pixel, num_pixels, 0)
+		);
+	}
 
 	// Transfer result from gpu buffer to array
-	queue.enqueue_read_buffer(render_output, 0, sizeof(cl_uchar4) * options.width * options.height, output.data());
+	readback_event = queue.enqueue_read_buffer_async(
+		render_output, first_pixel * sizeof(cl_uchar4), num_pixels * sizeof(cl_uchar4),
+		output.data() + first_pixel * sizeof(cl_uchar4)
+	);
+	record_event("Readback", readback_event);
+	queue.flush();
+}
+
+void Tracer::use_all_devices() {
+	for (auto &other : compute::system::devices()) {
+		if (other.id() == device.id())
+			continue;
+
+		std::cout << "Also rendering on " << other.name() << " on " << other.vendor() << '\n';
+		secondary.push_back(std::make_unique<Tracer>(options.width, options.height, other));
+	}
+
+	device_throughput.assign(secondary.size() + 1, 1.0);
+	balance_bands();
+}
+
+void Tracer::sync_settings(Tracer &peer) const {
+	peer.options = options;
+	peer.scene_data = scene_data;
+	peer.preview_scale = preview_scale;
+	peer.preview_frames = preview_frames;
+	peer.reprojection = reprojection;
+	peer.max_history = max_history;
+	peer.depth_tolerance = depth_tolerance;
+	peer.specialize_bounces = specialize_bounces;
+	peer.deterministic = deterministic;
+	peer.cost_heatmap = cost_heatmap;
+	peer.heatmap_metric = heatmap_metric;
+	peer.ray_stats = ray_stats;
+	peer.compress_meshes = compress_meshes;
+	peer.texture_budget = texture_budget;
+	peer.geometry_budget = geometry_budget;
+	peer.denoise = denoise;
+	peer.denoiser.iterations = denoiser.iterations;
+	peer.denoiser.sigma_color = denoiser.sigma_color;
+	peer.denoiser.sigma_normal = denoiser.sigma_normal;
+	peer.denoiser.sigma_depth = denoiser.sigma_depth;
+}
+
+void Tracer::balance_bands() {
+	double total = 0.0;
+	for (double throughput : device_throughput) {
+		total += throughput;
+	}
+
+	// Contiguous bands, sized by the share of the throughput of each device
+	double cumulated = 0.0;
+	int begin = 0;
+	for (size_t i = 0; i <= secondary.size(); i++) {
+		Tracer &tracer = i == 0 ? *this : *secondary[i - 1];
+
+		cumulated += device_throughput[i];
+		int end = i == secondary.size() ? options.height : (int)(options.height * cumulated / total);
+
+		// At least one row each, so that every device keeps being measured and can win rows back
+		int devices_after = secondary.size() - i;
+		end = glm::min(glm::max(end, begin + 1), options.height - devices_after);
+
+		tracer.band_begin = begin;
+		tracer.band_end = glm::max(end, begin);
+		begin = tracer.band_end;
+	}
+}
+
+void Tracer::render_split(cl_uint ticks_stopped, std::vector<uint8_t> &output) {
+	// Moving the bands invalidates the accumulated rows, so only do it when starting over. The
+	// history kept by reprojection would be lost as well.
+	if (ticks_stopped == 1 && !pending_reprojection) {
+		balance_bands();
+	}
+
+	std::vector<Tracer *> tracers = { this };
+	for (auto &peer : secondary) {
+		sync_settings(*peer);
+		tracers.push_back(peer.get());
+	}
+
+	// Every device gets its work before the blocking steps of any of them
+	auto start = std::chrono::steady_clock::now();
+	for (auto *tracer : tracers) {
+		tracer->enqueue_frame(ticks_stopped);
+	}
+
+	// Completion time of each band, set from the callbacks of the driver. Shared with them, so it
+	// outlives this call if an exception leaves before they ran.
+	struct Completion {
+		std::mutex mutex;
+		std::condition_variable done;
+		std::vector<std::chrono::steady_clock::time_point> times;
+		size_t remaining;
+	};
+	auto completion = std::make_shared<Completion>();
+	completion->times.resize(tracers.size());
+	completion->remaining = tracers.size();
+
+	for (size_t i = 0; i < tracers.size(); i++) {
+		tracers[i]->frame_event.set_callback([completion, i]() {
+			std::lock_guard<std::mutex> lock(completion->mutex);
+			completion->times[i] = std::chrono::steady_clock::now();
+			completion->remaining--;
+			completion->done.notify_one();
+		});
+	}
+
+	if (cost_heatmap) {
+		scale_heatmap();
+	}
+
+	// Denoising waits for the device it runs for only, the others keep rendering meanwhile
+	for (auto *tracer : tracers) {
+		tracer->finish_frame(output);
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(completion->mutex);
+		completion->done.wait(lock, [&] { return completion->remaining == 0; });
+	}
+
+	for (size_t i = 0; i < tracers.size(); i++) {
+		tracers[i]->readback_event.wait();
+
+		std::chrono::duration<double> elapsed = completion->times[i] - start;
+		int rows = tracers[i]->band_end - tracers[i]->band_begin;
+		if (rows > 0) {
+			// Smoothed rows per second
+			double measured = rows / glm::max(elapsed.count(), 1e-6);
+			device_throughput[i] = glm::mix(device_throughput[i], measured, 0.2);
+		}
+	}
 }
@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+"""Embeds a file into a C++ header as a byte array.
+
+Usage: embed.py <input> <output> <name>
+
+The header defines `embedded::<name>`, an array holding the bytes of the input file.
+"""
+
+import os
+import sys
+
+
+def main():
+    if len(sys.argv) != 4:
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+
+    input_path, output_path, name = sys.argv[1:]
+
+    with open(input_path, 'rb') as f:
+        data = f.read()
+
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append('\t' + ''.join(f'0x{byte:02x}, ' for byte in data[i:i + 16]).rstrip())
+
+    with open(output_path, 'w') as f:
+        f.write(f'// Generated from {os.path.basename(input_path)} by tools/embed.py, do not edit\n')
+        f.write('#pragma once\n\n')
+        f.write('namespace embedded {\n')
+        f.write(f'inline constexpr unsigned char {name}[] = {{\n')
+        f.write('\n'.join(lines))
+        f.write('\n};\n')
+        f.write('} // namespace embedded\n')
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Renders with N local worker processes: tools/farm_local.sh [N] [coordinator options...]
+set -e
+
+tracer=${TRACER:-./build/tracer}
+count=${1:-4}
+[ $# -gt 0 ] && shift
+
+base_port=7400
+workers=""
+pids=""
+i=0
+while [ "$i" -lt "$count" ]; do
+	port=$((base_port + i))
+	"$tracer" --worker "$port" &
+	pids="$pids $!"
+	workers="$workers${workers:+,}localhost:$port"
+	i=$((i + 1))
+done
+trap 'kill $pids 2>/dev/null' EXIT
+
+# Give the workers time to listen
+sleep 1
+"$tracer" --coordinator "$workers" "$@"